@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "segtree.h"
+
+// How a query treats updates which are still queued.
+enum class ReadMode
+{
+  // Read the tree as of the last applied batch. The result reflects a prefix
+  // of the queue, but possibly not updates enqueued before the call.
+  kStale,
+  // Apply every update enqueued before the call first.
+  kFlushed,
+};
+
+/**
+ * @brief A SegmentTree behind a lock-free multi-producer single-consumer
+ * queue. Updates never block: they are only enqueued, and applied later in
+ * batches by whichever thread drains the queue (Flush, or a kFlushed query).
+ *
+ * Queued updates to the same range are combined with ComposeWith before the
+ * batch is applied, and each batch is applied in a single traversal.
+ */
+class AsyncSegmentTree
+{
+public:
+  static constexpr size_t kDefaultBatch = 4096;
+
+  AsyncSegmentTree(const std::vector<int> &arr) : tree_(arr)
+  {
+    head_.store(&stub_, std::memory_order_relaxed);
+    tail_ = &stub_;
+  }
+
+  AsyncSegmentTree(const AsyncSegmentTree &) = delete;
+  AsyncSegmentTree &operator=(const AsyncSegmentTree &) = delete;
+
+  ~AsyncSegmentTree()
+  {
+    while (Node *node = Pop())
+      delete node;
+  }
+
+  /**
+   * @brief Enqueue an update. Safe to call from any number of threads.
+   * @return The ticket of the update. Updates are applied in ticket order up
+   * to the interleaving of concurrent producers.
+   */
+  uint64_t ApplyToRange(Cube domain, const Operation &op)
+  {
+    uint64_t ticket = next_ticket_.fetch_add(1, std::memory_order_relaxed);
+    Node *node = new Node;
+    node->update = {domain, op};
+    node->ticket = ticket;
+    Push(node); // node may be consumed from here on.
+    return ticket;
+  }
+
+  uint64_t AssignRange(Cube domain, int val)
+  {
+    return ApplyToRange(domain, {true, val});
+  }
+
+  uint64_t AddToRange(Cube domain, int inc)
+  {
+    return ApplyToRange(domain, {false, inc});
+  }
+
+  /**
+   * @brief Apply at most max_batch queued updates.
+   * @return The number of updates taken off the queue.
+   */
+  size_t Flush(size_t max_batch = kDefaultBatch)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return FlushLocked(max_batch);
+  }
+
+  int QueryRange(Cube domain, ReadMode mode = ReadMode::kFlushed)
+  {
+    uint64_t target = next_ticket_.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (mode == ReadMode::kFlushed)
+    {
+      // Tickets below target belong to updates which are queued, or about to
+      // be (their producer is between taking the ticket and linking).
+      while (watermark_.load(std::memory_order_relaxed) < target)
+        if (FlushLocked(kDefaultBatch) == 0)
+          std::this_thread::yield();
+    }
+    return tree_.QueryRange(domain);
+  }
+
+  int Get(int i, ReadMode mode = ReadMode::kFlushed)
+  {
+    return QueryRange({i, i + 1}, mode);
+  }
+
+  // Every update with a ticket below the watermark has been applied.
+  uint64_t watermark() const
+  {
+    return watermark_.load(std::memory_order_acquire);
+  }
+
+  int size() { return tree_.size(); }
+
+private:
+  // Only combine with the last few queued updates, to keep draining linear.
+  static constexpr size_t kCombineWindow = 16;
+
+  struct Node
+  {
+    std::atomic<Node *> next = nullptr;
+    Update update;
+    uint64_t ticket = 0;
+  };
+
+  SegmentTree tree_;
+
+  // Producers swing head_; the consumer owns tail_. See Vyukov's intrusive
+  // MPSC queue.
+  std::atomic<Node *> head_;
+  Node *tail_;
+  Node stub_;
+
+  std::atomic<uint64_t> next_ticket_ = 0;
+  std::atomic<uint64_t> watermark_ = 0;
+  // Tickets applied ahead of the watermark.
+  std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>>
+      applied_;
+
+  // Guards tree_, tail_, applied_ and the batch: i.e. the consumer side.
+  std::mutex mutex_;
+  std::vector<Update> batch_;
+  std::vector<uint64_t> batch_tickets_;
+
+  void Push(Node *node)
+  {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Returns nullptr if the queue is empty, or if a producer has not finished
+  // linking the next node yet.
+  Node *Pop()
+  {
+    Node *tail = tail_;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_)
+    {
+      if (next == nullptr)
+        return nullptr;
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr)
+    {
+      tail_ = next;
+      return tail;
+    }
+    if (tail != head_.load(std::memory_order_acquire))
+      return nullptr;
+    // tail is the last node: re-insert the stub behind it so tail can go.
+    Push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr)
+    {
+      tail_ = next;
+      return tail;
+    }
+    return nullptr;
+  }
+
+  // Combine update with a queued update to the same range, as long as no
+  // overlapping update lies between them.
+  void Combine(const Update &update)
+  {
+    size_t stop = batch_.size() > kCombineWindow
+                      ? batch_.size() - kCombineWindow
+                      : 0;
+    for (size_t i = batch_.size(); i > stop; i--)
+    {
+      Update &prev = batch_[i - 1];
+      if (prev.domain == update.domain)
+      {
+        prev.op.ComposeWith(update.op);
+        return;
+      }
+      if (!prev.domain.IsDisjointFrom(update.domain))
+        break;
+    }
+    batch_.push_back(update);
+  }
+
+  void MarkApplied(uint64_t ticket)
+  {
+    uint64_t watermark = watermark_.load(std::memory_order_relaxed);
+    if (ticket != watermark)
+    {
+      applied_.push(ticket);
+      return;
+    }
+    watermark++;
+    while (!applied_.empty() && applied_.top() == watermark)
+    {
+      applied_.pop();
+      watermark++;
+    }
+    watermark_.store(watermark, std::memory_order_release);
+  }
+
+  size_t FlushLocked(size_t max_batch)
+  {
+    batch_.clear();
+    batch_tickets_.clear();
+    while (batch_tickets_.size() < max_batch)
+    {
+      Node *node = Pop();
+      if (node == nullptr)
+        break;
+      Combine(node->update);
+      batch_tickets_.push_back(node->ticket);
+      delete node;
+    }
+
+    tree_.ApplyBatch(batch_);
+    for (uint64_t ticket : batch_tickets_)
+      MarkApplied(ticket);
+    return batch_tickets_.size();
+  }
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief A range add, range sum tree which any number of threads may update
+ * and query at once, without locks: updates are wait-free, and queries
+ * retry while an update touching what they read is in flight.
+ *
+ * Tags never move. sum_[v] is the sum of v's domain counting the additions
+ * to v and to its descendants, and add_[v] what was added to every element
+ * of v's domain by updates covering v. An update is then one fetch_add on
+ * the tag and sum of each of its O(log n) covering nodes, and on the sum of
+ * each of their ancestors; a query adds the sums of its covering nodes and
+ * the tags of their ancestors, weighted by the size of the intersection.
+ * Every word is accessed through std::atomic_ref, with sequentially
+ * consistent operations.
+ *
+ * Every sum and tag has a Version, which counts the updates that began and
+ * ended writing it. An update first counts itself as begun on all the words
+ * it writes, then writes them, then counts itself as ended on them. A query
+ * reads each word after checking that no update is in flight on it, then
+ * checks that no update began on any of them since: then it read them as of
+ * a single point in time. Otherwise it retries. So a query only waits for
+ * the updates whose words it reads, and updates in other parts of the tree
+ * neither contend with it nor delay it; but a stream of overlapping updates
+ * can starve it, so queries are not lock-free.
+ *
+ * Consistency, for single range operations: every operation is
+ * linearizable. Updates commute, so the tree is exact as soon as the
+ * updates issued have returned, whatever their order, and a query returns
+ * the sum as of a point during the call. Sums wrap around on overflow, as
+ * with fetch_add.
+ */
+class AtomicSegmentTree
+{
+public:
+  AtomicSegmentTree(const std::vector<int> &arr)
+  {
+    size_ = arr.size();
+    sum_ = std::vector<int>(SegmentTree::NumNodes(size_), 0);
+    add_ = std::vector<int>(SegmentTree::NumNodes(size_), 0);
+    sum_version_ = std::vector<Version>(SegmentTree::NumNodes(size_));
+    add_version_ = std::vector<Version>(SegmentTree::NumNodes(size_));
+    if (size_ > 0)
+      BuildTree(arr, 0, size_, 0);
+  }
+
+  AtomicSegmentTree(const AtomicSegmentTree &) = delete;
+  AtomicSegmentTree &operator=(const AtomicSegmentTree &) = delete;
+
+  void AddToRange(Cube domain, int inc)
+  {
+    if (domain.Volume() <= 0)
+      return;
+    Visit(domain,
+          [&](int v, Cube, bool covers)
+          {
+            Add(sum_version_[v].begun, 1);
+            if (covers)
+              Add(add_version_[v].begun, 1);
+          });
+    Visit(domain,
+          [&](int v, Cube query_domain, bool covers)
+          {
+            // Unsigned, so that the product wraps around like the sums.
+            Add(sum_[v], int(unsigned(query_domain.Volume()) * unsigned(inc)));
+            if (covers)
+              Add(add_[v], inc);
+          });
+    Visit(domain,
+          [&](int v, Cube, bool covers)
+          {
+            Add(sum_version_[v].ended, 1);
+            if (covers)
+              Add(add_version_[v].ended, 1);
+          });
+  }
+
+  int QueryRange(Cube domain) const
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    while (true)
+    {
+      // The query reads the sums of the nodes it covers, and the tags of
+      // the others.
+      unsigned sum = 0;
+      uint64_t ended = 0;
+      bool in_flight = false;
+      Visit(domain,
+            [&](int v, Cube query_domain, bool covers)
+            {
+              const Version &version =
+                  covers ? sum_version_[v] : add_version_[v];
+              // ended first: if begun then equals it, it did at that load.
+              uint64_t version_ended = Load(version.ended);
+              in_flight |= Load(version.begun) != version_ended;
+              ended += version_ended;
+              sum += covers ? unsigned(Load(sum_[v]))
+                            : unsigned(query_domain.Volume()) *
+                                  unsigned(Load(add_[v]));
+            });
+      if (in_flight)
+        continue;
+      // Counts only grow, and begun >= ended: the sums are equal only if no
+      // update began on a word read since it was read.
+      uint64_t begun = 0;
+      Visit(domain,
+            [&](int v, Cube, bool covers)
+            {
+              begun += Load(covers ? sum_version_[v].begun
+                                   : add_version_[v].begun);
+            });
+      if (begun == ended)
+        return int(sum);
+    }
+  }
+
+  int Get(int i) const { return QueryRange({i, i + 1}); }
+
+  int size() const { return size_; }
+
+private:
+  // Updates which began and ended writing a word.
+  struct Version
+  {
+    uint64_t begun = 0;
+    uint64_t ended = 0;
+  };
+
+  int size_;
+  std::vector<int> sum_;
+  std::vector<int> add_;
+  std::vector<Version> sum_version_;
+  std::vector<Version> add_version_;
+
+  static int Left(int v) { return 2 * v + 1; }
+  static int Right(int v) { return 2 * v + 2; }
+
+  template <class T>
+  static void Add(const T &x, std::type_identity_t<T> inc)
+  {
+    std::atomic_ref<T>(const_cast<T &>(x)).fetch_add(inc);
+  }
+
+  template <class T> static T Load(const T &x)
+  {
+    return std::atomic_ref<T>(const_cast<T &>(x)).load();
+  }
+
+  /**
+   * @brief Call fn(v, query_domain & domain of v, covers) on every node v an
+   * operation on query_domain visits, in preorder: the nodes it covers, and
+   * their ancestors.
+   */
+  template <class Fn> void Visit(Cube query_domain, Fn &&fn) const
+  {
+    VisitR(0, query_domain, {0, size()}, fn);
+  }
+
+  template <class Fn>
+  void VisitR(int v, Cube query_domain, Cube node_domain, Fn &fn) const
+  {
+    if (query_domain == node_domain) // range covers this node.
+    {
+      fn(v, query_domain, true);
+      return;
+    }
+    fn(v, query_domain, false);
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      VisitR(Left(v), left_node_domain & query_domain, left_node_domain, fn);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      VisitR(Right(v), right_node_domain & query_domain, right_node_domain,
+             fn);
+  }
+
+  void BuildTree(const std::vector<int> &arr, int l, int r, int v)
+  {
+    if (r - l == 1)
+      sum_[v] = arr[l];
+    else
+    {
+      BuildTree(arr, l, (l + r) / 2, Left(v));
+      BuildTree(arr, (l + r) / 2, r, Right(v));
+      sum_[v] = int(unsigned(sum_[Left(v)]) + unsigned(sum_[Right(v)]));
+    }
+  }
+};
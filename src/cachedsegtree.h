@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief A SegmentTree with a fixed-size cache of query results, for
+ * workloads which repeat the same ranges between rare updates.
+ *
+ * Updates stamp the nodes they walk through with their sequence number, and
+ * the nodes they cover entirely also in covered_. A cached range is fresh if
+ * no later update intersected it, which is checked by walking down the
+ * range's nodes on the stamps only, and stopping at the subtrees no update
+ * went through since. A hit is thus a hash probe, plus a short walk over the
+ * stamps if there were updates since the entry was last checked; it never
+ * touches the tree itself.
+ */
+class CachedSegmentTree
+{
+public:
+  // capacity is rounded up to a power of two.
+  CachedSegmentTree(const std::vector<int> &arr, int capacity = 4096)
+      : tree_(arr), touched_(SegmentTree::NumNodes(arr.size()), 0),
+        covered_(SegmentTree::NumNodes(arr.size()), 0),
+        entries_(std::bit_ceil(unsigned(std::max(capacity, 1))))
+  {
+  }
+
+  void ApplyToRange(Cube domain, const Operation &op)
+  {
+    if (domain.Volume() <= 0)
+      return;
+    seq_++;
+    StampR(0, domain, {0, size()});
+    tree_.ApplyToRange(domain, op);
+  }
+
+  void AssignRange(Cube domain, int val) { ApplyToRange(domain, {true, val}); }
+
+  void AddToRange(Cube domain, int inc) { ApplyToRange(domain, {false, inc}); }
+
+  int QueryRange(Cube domain)
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    Entry &entry = entries_[Hash(domain) & (entries_.size() - 1)];
+    if (entry.seq > 0 && entry.domain == domain &&
+        IsFreshR(0, domain, {0, size()}, entry.seq))
+    {
+      hits_++;
+      // Spare the walk next time.
+      entry.seq = seq_ + 1;
+      return entry.value;
+    }
+    misses_++;
+    entry = {domain, tree_.QueryRange(domain), seq_ + 1};
+    return entry.value;
+  }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  int size() { return tree_.size(); }
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+private:
+  struct Entry
+  {
+    Cube domain;
+    int value;
+    // One more than the sequence number of the last update before value was
+    // computed, or 0 if the entry is empty.
+    uint64_t seq = 0;
+  };
+
+  SegmentTree tree_;
+  // Sequence number of the last update.
+  uint64_t seq_ = 0;
+  // Per node: the last update which went through it, or covered it.
+  std::vector<uint64_t> touched_;
+  std::vector<uint64_t> covered_;
+  std::vector<Entry> entries_;
+
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+
+  // Same layout as SegmentTree.
+  static int Left(int v) { return 2 * v + 1; }
+  static int Right(int v) { return 2 * v + 2; }
+
+  static uint64_t Hash(Cube domain)
+  {
+    uint64_t key = uint64_t(uint32_t(domain.l)) << 32 | uint32_t(domain.r);
+    key *= 0x9e3779b97f4a7c15;
+    return key ^ (key >> 29);
+  }
+
+  // Whether no update since seq intersected query_domain. The ancestors of
+  // v were not covered by any such update.
+  bool IsFreshR(int v, Cube query_domain, Cube node_domain, uint64_t seq)
+  {
+    if (touched_[v] < seq) // no such update below v either.
+      return true;
+    if (query_domain == node_domain || covered_[v] >= seq)
+      return false;
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    if (!query_domain.IsDisjointFrom(left_node_domain) &&
+        !IsFreshR(Left(v), left_node_domain & query_domain, left_node_domain,
+                  seq))
+      return false;
+    if (!query_domain.IsDisjointFrom(right_node_domain) &&
+        !IsFreshR(Right(v), right_node_domain & query_domain,
+                  right_node_domain, seq))
+      return false;
+    return true;
+  }
+
+  // Walks the nodes SegmentTree::ApplyToRange walks.
+  void StampR(int v, Cube query_domain, Cube node_domain)
+  {
+    touched_[v] = seq_;
+    if (query_domain == node_domain) // range covers this node.
+    {
+      covered_[v] = seq_;
+      return;
+    }
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      StampR(Left(v), left_node_domain & query_domain, left_node_domain);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      StampR(Right(v), right_node_domain & query_domain, right_node_domain);
+  }
+};
@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fdio.h"
+#include "segtree.h"
+#include "uring.h"
+
+// How RestoreCheckpoint reads checkpoints.
+struct RestoreOptions
+{
+  // Reads of the base checkpoint in flight: the io_uring queue depth, or the
+  // number of threads issuing preads where io_uring is unavailable. 1 reads
+  // it sequentially.
+  int parallelism = 1;
+  // Bytes per read of the base checkpoint.
+  int chunk_bytes = 1 << 20;
+  // Check every block against its checksum, in parallel, and throw
+  // std::runtime_error on a mismatch.
+  bool verify = false;
+};
+
+/**
+ * @brief Full and incremental checkpoints of a SegmentTree, read and written
+ * straight from its pages. Use the free functions below.
+ */
+class SegmentTreeCheckpoint
+{
+public:
+  static SegmentTree Restore(int base_fd, std::span<const int> delta_fds,
+                             const RestoreOptions &options)
+  {
+    CheckpointHeader header = ReadCheckpointHeader(base_fd);
+    if (header.incremental)
+      throw std::runtime_error("checkpoint: base checkpoint is incremental");
+
+    SegmentTree tree;
+    tree.Allocate(header.size);
+    if (options.parallelism > 1)
+      ReadBlocksParallel(tree, base_fd, header, options);
+    else
+      ReadBlocks(tree, base_fd, header, options.verify);
+    for (int fd : delta_fds)
+    {
+      uint64_t generation = header.generation, lineage = header.lineage;
+      header = ReadCheckpointHeader(fd);
+      if (!header.incremental || header.parent_generation != generation ||
+          header.parent_lineage != lineage || header.size != tree.size())
+        throw std::runtime_error("checkpoint: broken chain of checkpoints");
+      ReadBlocks(tree, fd, header, options.verify);
+    }
+
+    tree.checkpoint_generation_ = header.generation;
+    tree.checkpoint_lineage_ = header.lineage;
+    tree.tree_.ClearDirty();
+    tree.operations_.ClearDirty();
+    return tree;
+  }
+
+  static void Write(SegmentTree &tree, int fd, bool incremental)
+  {
+    if (!tree.unbuilt_.empty() && tree.size_ > 0)
+      tree.Build(0, {0, tree.size_});
+    std::vector<CheckpointBlock> manifest;
+    std::vector<struct iovec> blocks;
+    AppendBlocks(tree.tree_, 0, incremental, manifest, blocks);
+    AppendBlocks(tree.operations_, 1, incremental, manifest, blocks);
+
+    if (tree.lineage_ == 0)
+      tree.lineage_ = NewLineage();
+    CheckpointHeader header = {kCheckpointMagic,
+                               incremental,
+                               tree.checkpoint_generation_ + 1,
+                               tree.checkpoint_generation_,
+                               tree.lineage_,
+                               tree.checkpoint_lineage_,
+                               tree.size_,
+                               uint32_t(manifest.size())};
+    WriteFully(fd, &header, sizeof(header));
+    WriteFully(fd, manifest.data(), manifest.size() * sizeof(CheckpointBlock));
+    WritevFully(fd, blocks.data(), blocks.size());
+
+    tree.checkpoint_generation_++;
+    tree.checkpoint_lineage_ = tree.lineage_;
+    tree.tree_.ClearDirty();
+    tree.operations_.ClearDirty();
+  }
+
+private:
+  // Checkpoints start with a header, followed by num_blocks CheckpointBlocks
+  // (the manifest), followed by the blocks in manifest order. Everything is
+  // in native byte order.
+  static constexpr uint32_t kCheckpointMagic = 0x33534c4a; // "JLS3"
+
+  struct CheckpointHeader
+  {
+    uint32_t magic;
+    uint32_t incremental;
+    uint64_t generation;
+    // The generation an incremental checkpoint applies on top of.
+    uint64_t parent_generation;
+    // The tree's lineage, and the lineage of the parent generation: a delta
+    // only applies on top of a checkpoint of its parent lineage.
+    uint64_t lineage;
+    uint64_t parent_lineage;
+    int32_t size;
+    uint32_t num_blocks;
+  };
+
+  struct CheckpointBlock
+  {
+    uint32_t array; // 0 for tree_, 1 for operations_.
+    uint32_t page;
+    uint64_t checksum; // BlockChecksum of the block.
+  };
+
+  template <class T>
+  static void AppendBlocks(const CowArray<T> &array, uint32_t id,
+                           bool dirty_only,
+                           std::vector<CheckpointBlock> &manifest,
+                           std::vector<struct iovec> &blocks)
+  {
+    for (int p = 0; p < array.num_pages(); p++)
+      if (!dirty_only || array.IsDirty(p))
+      {
+        struct iovec block = {const_cast<T *>(array.page(p)),
+                              CowArray<T>::kPageSize * sizeof(T)};
+        manifest.push_back({id, uint32_t(p), BlockChecksum(block)});
+        blocks.push_back(block);
+      }
+  }
+
+  // A random nonzero lineage, unique across processes too.
+  static uint64_t NewLineage()
+  {
+    std::random_device device;
+    uint64_t lineage = 0;
+    while (lineage == 0)
+      lineage = uint64_t(device()) << 32 | device();
+    return lineage;
+  }
+
+  static CheckpointHeader ReadCheckpointHeader(int fd)
+  {
+    CheckpointHeader header;
+    ReadFully(fd, &header, sizeof(header));
+    if (header.magic != kCheckpointMagic)
+      throw std::runtime_error("checkpoint: bad magic");
+    return header;
+  }
+
+  // Where block goes in the tree, which must be allocated.
+  static struct iovec BlockDestination(SegmentTree &tree,
+                                       CheckpointBlock block)
+  {
+    if (block.array == 0 && block.page < uint32_t(tree.tree_.num_pages()))
+      return {tree.tree_.MutablePage(block.page),
+              CowArray<int>::kPageSize * sizeof(int)};
+    if (block.array == 1 &&
+        block.page < uint32_t(tree.operations_.num_pages()))
+      return {tree.operations_.MutablePage(block.page),
+              CowArray<Operation>::kPageSize * sizeof(Operation)};
+    throw std::runtime_error("checkpoint: bad manifest");
+  }
+
+  // A 64-bit hash of a block, over four independent lanes so that the
+  // multiplications overlap.
+  static uint64_t BlockChecksum(struct iovec block)
+  {
+    const char *data = static_cast<const char *>(block.iov_base);
+    uint64_t lanes[4] = {1, 2, 3, 4};
+    size_t i = 0;
+    for (; i + 32 <= block.iov_len; i += 32)
+      for (int j = 0; j < 4; j++)
+      {
+        uint64_t word;
+        std::memcpy(&word, data + i + 8 * j, 8);
+        lanes[j] = std::rotl((lanes[j] ^ word) * 0x9e3779b97f4a7c15, 29);
+      }
+    uint64_t hash = block.iov_len;
+    for (; i < block.iov_len; i++)
+      hash = (hash ^ uint8_t(data[i])) * 0x100000001b3;
+    for (uint64_t lane : lanes)
+      hash = std::rotl((hash ^ lane) * 0xbf58476d1ce4e5b9, 31);
+    return hash;
+  }
+
+  static void VerifyBlock(const CheckpointBlock &block,
+                          struct iovec destination)
+  {
+    if (BlockChecksum(destination) != block.checksum)
+      throw std::runtime_error("checkpoint: checksum mismatch");
+  }
+
+  static void ReadBlocks(SegmentTree &tree, int fd,
+                         const CheckpointHeader &header, bool verify)
+  {
+    std::vector<CheckpointBlock> manifest(header.num_blocks);
+    ReadFully(fd, manifest.data(), manifest.size() * sizeof(CheckpointBlock));
+    for (CheckpointBlock block : manifest)
+    {
+      struct iovec destination = BlockDestination(tree, block);
+      ReadFully(fd, destination.iov_base, destination.iov_len);
+      if (verify)
+        VerifyBlock(block, destination);
+    }
+  }
+
+  /**
+   * @brief Like ReadBlocks, but reads runs of blocks (chunks) concurrently,
+   * each with a single vectored read straight into the tree's pages. Uses
+   * io_uring if the kernel allows it, and a pool of pread threads otherwise.
+   */
+  static void ReadBlocksParallel(SegmentTree &tree, int fd,
+                                 const CheckpointHeader &header,
+                                 const RestoreOptions &options)
+  {
+    std::vector<CheckpointBlock> manifest(header.num_blocks);
+    ReadFully(fd, manifest.data(), manifest.size() * sizeof(CheckpointBlock));
+    off_t start = ::lseek(fd, 0, SEEK_CUR);
+    if (start < 0)
+      throw std::system_error(errno, std::generic_category(), "lseek");
+
+    // Chunk c is blocks [c * per_chunk, (c + 1) * per_chunk), at offsets[c].
+    std::vector<struct iovec> destinations;
+    destinations.reserve(manifest.size());
+    for (CheckpointBlock block : manifest)
+      destinations.push_back(BlockDestination(tree, block));
+    int per_chunk = std::clamp(options.chunk_bytes / 4096, 1, IOV_MAX);
+    int num_chunks = (manifest.size() + per_chunk - 1) / per_chunk;
+    std::vector<off_t> offsets(num_chunks + 1, start);
+    for (size_t i = 0; i < manifest.size(); i++)
+      offsets[i / per_chunk + 1] += destinations[i].iov_len;
+    for (int c = 0; c < num_chunks; c++)
+      offsets[c + 1] += offsets[c] - start;
+
+    auto Chunk = [&](int c)
+    {
+      size_t first = size_t(c) * per_chunk;
+      return std::span<struct iovec>(destinations)
+          .subspan(first, std::min<size_t>(per_chunk, manifest.size() - first));
+    };
+    auto VerifyChunk = [&](int c)
+    {
+      for (size_t i = size_t(c) * per_chunk;
+           i < std::min(manifest.size(), size_t(c + 1) * per_chunk); i++)
+        VerifyBlock(manifest[i], destinations[i]);
+    };
+
+    std::unique_ptr<IoUring> ring;
+    try
+    {
+      ring = std::make_unique<IoUring>(options.parallelism);
+    }
+    catch (const std::system_error &)
+    {
+    }
+
+    if (ring)
+    {
+      ReadChunksUring(*ring, fd, num_chunks, Chunk, offsets,
+                      options.parallelism);
+      if (options.verify)
+        ForEachInParallel(num_chunks, std::thread::hardware_concurrency(),
+                          VerifyChunk);
+    }
+    else
+      ForEachInParallel(num_chunks, options.parallelism,
+                        [&](int c)
+                        {
+                          std::span<struct iovec> chunk = Chunk(c);
+                          std::vector<struct iovec> iov(chunk.begin(),
+                                                        chunk.end());
+                          PreadvFully(fd, iov.data(), iov.size(), offsets[c]);
+                          if (options.verify)
+                            VerifyChunk(c);
+                        });
+
+    // Leave fd after the checkpoint, as ReadBlocks does.
+    if (::lseek(fd, offsets[num_chunks], SEEK_SET) < 0)
+      throw std::system_error(errno, std::generic_category(), "lseek");
+  }
+
+  // Read every chunk through ring, keeping parallelism reads in flight. The
+  // kernel may round the ring up, so its capacity is not the bound.
+  template <class ChunkFn>
+  static void ReadChunksUring(IoUring &ring, int fd, int num_chunks,
+                              ChunkFn &Chunk, const std::vector<off_t> &offsets,
+                              int parallelism)
+  {
+    int next = 0, in_flight = 0;
+    try
+    {
+      while (next < num_chunks || in_flight > 0)
+      {
+        for (; next < num_chunks && in_flight < parallelism;
+             next++, in_flight++)
+        {
+          std::span<struct iovec> chunk = Chunk(next);
+          if (!ring.PrepareReadv(fd, chunk.data(), chunk.size(), offsets[next],
+                                 next))
+            break;
+        }
+        ring.Submit(1);
+
+        uint64_t c;
+        int res;
+        while (ring.Reap(c, res))
+        {
+          in_flight--;
+          if (res < 0)
+            throw std::system_error(-res, std::generic_category(), "readv");
+          // Finish a short read synchronously.
+          std::span<struct iovec> chunk = Chunk(c);
+          std::vector<struct iovec> rest(chunk.begin(), chunk.end());
+          size_t skip = res;
+          auto it = rest.begin();
+          for (; it != rest.end() && skip >= it->iov_len; it++)
+            skip -= it->iov_len;
+          if (it == rest.end())
+            continue;
+          it->iov_base = static_cast<char *>(it->iov_base) + skip;
+          it->iov_len -= skip;
+          PreadvFully(fd, &*it, rest.end() - it, offsets[c] + res);
+        }
+      }
+    }
+    catch (...)
+    {
+      // The reads still in flight land in the tree's pages, which go away
+      // with the exception.
+      ring.Drain();
+      throw;
+    }
+  }
+
+  // Call fn(0), ..., fn(n - 1) from up to threads threads, and rethrow the
+  // first exception thrown, once every thread is done.
+  template <class Fn> static void ForEachInParallel(int n, int threads, Fn fn)
+  {
+    std::atomic<int> next = 0;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto Work = [&]
+    {
+      for (int i; (i = next.fetch_add(1)) < n;)
+        try
+        {
+          fn(i);
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error)
+            error = std::current_exception();
+          next = n;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < std::min(std::max(threads, 1), n); t++)
+      pool.emplace_back(Work);
+    Work();
+    for (std::thread &thread : pool)
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+/**
+ * @brief Write the whole tree to fd. Changes are tracked from here on for
+ * WriteIncrementalCheckpoint.
+ */
+inline void WriteCheckpoint(SegmentTree &tree, int fd)
+{
+  SegmentTreeCheckpoint::Write(tree, fd, false);
+}
+
+/**
+ * @brief Write only the 4KB blocks of tree changed since its previous
+ * checkpoint (full or incremental) to fd, preceded by a manifest of their
+ * positions.
+ */
+inline void WriteIncrementalCheckpoint(SegmentTree &tree, int fd)
+{
+  SegmentTreeCheckpoint::Write(tree, fd, true);
+}
+
+/**
+ * @brief Rebuild a tree from a full checkpoint and the incremental
+ * checkpoints written after it, in order. See RestoreOptions for reading
+ * the base checkpoint in parallel.
+ * @throws std::runtime_error if the checkpoints do not form a chain, or
+ * options.verify is set and a block does not match its checksum.
+ */
+inline SegmentTree RestoreCheckpoint(int base_fd,
+                                     std::span<const int> delta_fds = {},
+                                     const RestoreOptions &options = {})
+{
+  return SegmentTreeCheckpoint::Restore(base_fd, delta_fds, options);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief A SegmentTree shared by many threads through flat combining.
+ *
+ * Every thread publishes its operation in a slot of its own and waits. The
+ * thread which gets the lock collects every published operation and
+ * executes them as one ExecuteOrdered batch, on behalf of the others. So the
+ * lock changes hands once per batch rather than once per operation, and the
+ * tree stays in the combiner's cache.
+ *
+ * Operations are linearizable: each takes effect at some point while its
+ * caller waits, in the order of the batch which executes it.
+ */
+class CombiningSegmentTree
+{
+public:
+  CombiningSegmentTree(const std::vector<int> &arr)
+      : id_(next_id_.fetch_add(1, std::memory_order_relaxed)), tree_(arr)
+  {
+  }
+
+  CombiningSegmentTree(const CombiningSegmentTree &) = delete;
+  CombiningSegmentTree &operator=(const CombiningSegmentTree &) = delete;
+
+  void ApplyToRange(Cube domain, const Operation &op)
+  {
+    Execute({domain, op, false});
+  }
+
+  void AssignRange(Cube domain, int val) { ApplyToRange(domain, {true, val}); }
+
+  void AddToRange(Cube domain, int inc) { ApplyToRange(domain, {false, inc}); }
+
+  int QueryRange(Cube domain) { return Execute({domain, {}, true}); }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  int size() { return tree_.size(); }
+
+private:
+  // Polls of the slot before the waiter starts yielding between polls.
+  static constexpr int kSpins = 64;
+
+  enum SlotState
+  {
+    kIdle,
+    kPending,
+    kDone,
+  };
+
+  // One thread's published operation.
+  struct alignas(64) Slot
+  {
+    std::atomic<int> state = kIdle;
+    Op op;
+  };
+
+  // Entries of a thread's slot cache; see LocalSlot.
+  static constexpr int kCacheSize = 4;
+
+  // Tree ids, and thread ids which (unlike std::thread::id) are never
+  // reused: a slot has a single owner for good.
+  inline static std::atomic<uint64_t> next_id_ = 1;
+  inline static std::atomic<uint64_t> next_thread_ = 0;
+
+  // Identifies this tree in the thread-local slot caches. Never reused, so
+  // entries left behind by destroyed trees never match.
+  const uint64_t id_;
+
+  // Held by the combiner. Guards tree_, slots_, owners_ and the batch.
+  std::mutex mutex_;
+  SegmentTree tree_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+  std::unordered_map<uint64_t, Slot *> owners_;
+  std::vector<Op> batch_;
+  std::vector<Slot *> batch_slots_;
+
+  int Execute(const Op &op)
+  {
+    Slot &slot = LocalSlot();
+    slot.op = op;
+    slot.state.store(kPending, std::memory_order_release);
+
+    for (int spins = 0;; spins++)
+    {
+      if (slot.state.load(std::memory_order_acquire) == kDone)
+        break;
+      if (mutex_.try_lock())
+      {
+        Combine();
+        mutex_.unlock();
+      }
+      else if (spins >= kSpins)
+        std::this_thread::yield();
+    }
+    slot.state.store(kIdle, std::memory_order_relaxed);
+    return slot.op.result;
+  }
+
+  // Execute every pending operation. Requires mutex_.
+  void Combine()
+  {
+    batch_.clear();
+    batch_slots_.clear();
+    for (const std::unique_ptr<Slot> &slot : slots_)
+      if (slot->state.load(std::memory_order_acquire) == kPending)
+      {
+        batch_.push_back(slot->op);
+        batch_slots_.push_back(slot.get());
+      }
+    if (batch_.empty())
+      return;
+
+    tree_.ExecuteOrdered(batch_);
+    for (size_t i = 0; i < batch_.size(); i++)
+    {
+      batch_slots_[i]->op.result = batch_[i].result;
+      batch_slots_[i]->state.store(kDone, std::memory_order_release);
+    }
+  }
+
+  // The calling thread's slot. A small thread-local cache of the trees it
+  // used last avoids the lock; on a miss, the slot is looked up (or created)
+  // under it, and replaces the oldest entry.
+  Slot &LocalSlot()
+  {
+    struct Entry
+    {
+      uint64_t id = 0;
+      Slot *slot = nullptr;
+    };
+    thread_local Entry cache[kCacheSize];
+    thread_local int next = 0;
+    thread_local const uint64_t thread =
+        next_thread_.fetch_add(1, std::memory_order_relaxed);
+    for (const Entry &entry : cache)
+      if (entry.id == id_)
+        return *entry.slot;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot *&slot = owners_[thread];
+    if (slot == nullptr)
+    {
+      slots_.push_back(std::make_unique<Slot>());
+      slot = slots_.back().get();
+    }
+    cache[next] = {id_, slot};
+    next = (next + 1) % kCacheSize;
+    return *slot;
+  }
+};
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "segtree.h"
+
+/**
+ * @brief 128 ints packed with frame-of-reference and bit packing: each value
+ * is stored as value - base in width bits.
+ *
+ * The layout is vertical (as in SIMD-BP128): value i belongs to lane i % 4,
+ * and the k-th word of lane j is words[4 * k + j], so four values are
+ * unpacked at once with the same shifts.
+ */
+struct PackedBlock
+{
+  static constexpr int kSize = 128;
+  static constexpr int kLanes = 4;
+
+  int base = 0;
+  int width = 0;
+  std::vector<uint32_t> words;
+
+  void Pack(const int *values)
+  {
+    auto [lo, hi] = std::minmax_element(values, values + kSize);
+    base = *lo;
+    width = std::bit_width(uint32_t(int64_t(*hi) - *lo));
+    words.assign(kLanes * width, 0);
+    if (width == 0)
+      return;
+    for (int i = 0; i < kSize; i++)
+    {
+      uint32_t delta = uint32_t(int64_t(values[i]) - base);
+      int lane = i % kLanes, bit = i / kLanes * width;
+      int word = bit / 32, shift = bit % 32;
+      words[kLanes * word + lane] |= delta << shift;
+      if (shift + width > 32)
+        words[kLanes * (word + 1) + lane] |= delta >> (32 - shift);
+    }
+  }
+
+  void Unpack(int *values) const
+  {
+    if (width == 0)
+    {
+      std::fill_n(values, kSize, base);
+      return;
+    }
+    uint32_t mask = width == 32 ? ~0u : (1u << width) - 1;
+#ifdef __SSE2__
+    const __m128i vmask = _mm_set1_epi32(mask);
+    const __m128i vbase = _mm_set1_epi32(base);
+    for (int i = 0; i < kSize / kLanes; i++)
+    {
+      int bit = i * width, word = bit / 32, shift = bit % 32;
+      const __m128i *lanes = reinterpret_cast<const __m128i *>(words.data());
+      __m128i v = _mm_srl_epi32(_mm_loadu_si128(lanes + word),
+                                _mm_cvtsi32_si128(shift));
+      if (shift + width > 32)
+        v = _mm_or_si128(v, _mm_sll_epi32(_mm_loadu_si128(lanes + word + 1),
+                                          _mm_cvtsi32_si128(32 - shift)));
+      v = _mm_add_epi32(_mm_and_si128(v, vmask), vbase);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(values + kLanes * i), v);
+    }
+#else
+    for (int i = 0; i < kSize; i++)
+    {
+      int lane = i % kLanes, bit = i / kLanes * width;
+      int word = bit / 32, shift = bit % 32;
+      uint32_t delta = words[kLanes * word + lane] >> shift;
+      if (shift + width > 32)
+        delta |= words[kLanes * (word + 1) + lane] << (32 - shift);
+      values[i] = int(uint32_t(base) + (delta & mask));
+    }
+#endif
+  }
+};
+
+/**
+ * @brief A range add/assign, range sum tree for large arrays which are
+ * mostly cold. The leaves are grouped in blocks of 128, kept compressed
+ * (PackedBlock), and a small cache holds the decompressed blocks in use.
+ *
+ * A lazy tree over the blocks holds the block sums. Updates and queries
+ * covering whole blocks stop there; only partially covered blocks are
+ * decompressed.
+ */
+class CompressedSegmentTree
+{
+public:
+  static constexpr int kBlockSize = PackedBlock::kSize;
+
+  CompressedSegmentTree(const std::vector<int> &arr, int cache_blocks = 64)
+  {
+    size_ = arr.size();
+    num_blocks_ = (size_ + kBlockSize - 1) / kBlockSize;
+    tree_ = std::vector<int>(4 * num_blocks_ + 1, 0);
+    operations_ = std::vector<Operation>(4 * num_blocks_ + 1, Operation());
+    blocks_ = std::vector<PackedBlock>(num_blocks_);
+    slot_of_ = std::vector<int>(num_blocks_, -1);
+    slots_ = std::vector<Slot>(std::max(cache_blocks, 1));
+    if (num_blocks_ > 0)
+      BuildTree(arr, 0, num_blocks_, 0);
+  }
+
+  void ApplyToRange(Cube domain, const Operation &op)
+  {
+    if (domain.Volume() > 0)
+      ApplyOperationR(0, domain, 0, num_blocks_, op);
+  }
+
+  void AssignRange(Cube domain, int val) { ApplyToRange(domain, {true, val}); }
+
+  void AddToRange(Cube domain, int inc) { ApplyToRange(domain, {false, inc}); }
+
+  int QueryRange(Cube domain)
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    return QueryRangeR(0, domain, 0, num_blocks_);
+  }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  int size() { return size_; }
+
+  // Approximate heap bytes used, including the cache.
+  size_t MemoryUsage() const
+  {
+    size_t bytes = tree_.size() * (sizeof(int) + sizeof(Operation)) +
+                   slot_of_.size() * sizeof(int) +
+                   slots_.size() * sizeof(Slot);
+    for (const PackedBlock &block : blocks_)
+      bytes += sizeof(block) + block.words.capacity() * sizeof(uint32_t);
+    return bytes;
+  }
+
+private:
+  struct Slot
+  {
+    int block = -1;
+    bool dirty = false;
+    // Cleared by the CLOCK hand, set on every use.
+    bool referenced = false;
+    int values[kBlockSize];
+  };
+
+  int size_;
+  int num_blocks_;
+
+  // Lazy tree over the blocks. The node of block b has domain
+  // [b * kBlockSize, (b + 1) * kBlockSize), clipped to size_, and its pending
+  // operation applies to the block's values.
+  std::vector<int> tree_;
+  std::vector<Operation> operations_;
+
+  std::vector<PackedBlock> blocks_;
+  // The cache slot holding a block, or -1. A dirty slot is more recent than
+  // the packed block.
+  std::vector<int> slot_of_;
+  std::vector<Slot> slots_;
+  int clock_hand_ = 0;
+
+  int Left(int v) { return 2 * v + 1; }
+  int Right(int v) { return 2 * v + 2; }
+
+  Cube Domain(int bl, int br)
+  {
+    return {bl * kBlockSize, std::min(br * kBlockSize, size_)};
+  }
+
+  void UpdateValueFromBelow(int v)
+  {
+    tree_[v] = tree_[Left(v)] + tree_[Right(v)];
+  }
+
+  void EvaluateAny(int v, Cube domain, const Operation &op)
+  {
+    tree_[v] = op.Evaluate(tree_[v], domain);
+    operations_[v].ComposeWith(op);
+  }
+
+  void Push(int v, int bl, int br)
+  {
+    if (operations_[v].IsIdentity())
+      return;
+    int bm = (bl + br) / 2;
+    EvaluateAny(Left(v), Domain(bl, bm), operations_[v]);
+    EvaluateAny(Right(v), Domain(bm, br), operations_[v]);
+    operations_[v].Reset();
+  }
+
+  // Decompressed values of block b, with CLOCK replacement.
+  Slot &Fetch(int b)
+  {
+    if (int s = slot_of_[b]; s >= 0)
+    {
+      slots_[s].referenced = true;
+      return slots_[s];
+    }
+
+    while (slots_[clock_hand_].referenced)
+    {
+      slots_[clock_hand_].referenced = false;
+      clock_hand_ = (clock_hand_ + 1) % slots_.size();
+    }
+    Slot &slot = slots_[clock_hand_];
+    if (slot.block >= 0)
+    {
+      if (slot.dirty)
+        blocks_[slot.block].Pack(slot.values);
+      slot_of_[slot.block] = -1;
+    }
+    slot.block = b;
+    slot.dirty = false;
+    slot.referenced = true;
+    blocks_[b].Unpack(slot.values);
+    slot_of_[b] = clock_hand_;
+    clock_hand_ = (clock_hand_ + 1) % slots_.size();
+    return slot;
+  }
+
+  // Apply op to the part of block b (node v) within query_domain.
+  void ApplyToBlock(int v, int b, Cube query_domain, const Operation &op)
+  {
+    Slot &slot = Fetch(b);
+    int offset = b * kBlockSize;
+    // Apply the block's pending operation first.
+    if (!operations_[v].IsIdentity())
+    {
+      for (int &value : slot.values)
+        value = operations_[v].Evaluate(value, {0, 1});
+      operations_[v].Reset();
+    }
+    for (int i = query_domain.l; i < query_domain.r; i++)
+      slot.values[i - offset] = op.Evaluate(slot.values[i - offset], {0, 1});
+    slot.dirty = true;
+
+    Cube block_domain = Domain(b, b + 1);
+    int sum = 0;
+    for (int i = block_domain.l; i < block_domain.r; i++)
+      sum += slot.values[i - offset];
+    tree_[v] = sum;
+  }
+
+  int QueryBlock(int v, int b, Cube query_domain)
+  {
+    const Slot &slot = Fetch(b);
+    int offset = b * kBlockSize;
+    int sum = 0;
+    for (int i = query_domain.l; i < query_domain.r; i++)
+      sum += slot.values[i - offset];
+    // The block's pending operation applies uniformly.
+    return operations_[v].Evaluate(sum, query_domain);
+  }
+
+  void ApplyOperationR(int v, Cube query_domain, int bl, int br,
+                       const Operation &op)
+  {
+    if (query_domain == Domain(bl, br)) // range covers this node.
+      EvaluateAny(v, query_domain, op);
+    else if (br - bl == 1)
+      ApplyToBlock(v, bl, query_domain, op);
+    else
+    {
+      Push(v, bl, br);
+      int bm = (bl + br) / 2;
+      Cube left_node_domain = Domain(bl, bm), right_node_domain = Domain(bm, br);
+      if (!query_domain.IsDisjointFrom(left_node_domain))
+        ApplyOperationR(Left(v), left_node_domain.IntersectWith(query_domain),
+                        bl, bm, op);
+      if (!query_domain.IsDisjointFrom(right_node_domain))
+        ApplyOperationR(Right(v),
+                        right_node_domain.IntersectWith(query_domain), bm, br,
+                        op);
+      UpdateValueFromBelow(v);
+    }
+  }
+
+  int QueryRangeR(int v, Cube query_domain, int bl, int br)
+  {
+    if (query_domain == Domain(bl, br)) // range covers this node.
+      return tree_[v];
+    if (br - bl == 1)
+      return QueryBlock(v, bl, query_domain);
+
+    Push(v, bl, br);
+    int bm = (bl + br) / 2;
+    Cube left_node_domain = Domain(bl, bm), right_node_domain = Domain(bm, br);
+    int sum = 0;
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      sum += QueryRangeR(Left(v), left_node_domain.IntersectWith(query_domain),
+                         bl, bm);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      sum += QueryRangeR(Right(v),
+                         right_node_domain.IntersectWith(query_domain), bm, br);
+    return sum;
+  }
+
+  void BuildTree(const std::vector<int> &arr, int bl, int br, int v)
+  {
+    if (br - bl == 1)
+    {
+      int values[kBlockSize] = {};
+      Cube domain = Domain(bl, br);
+      std::copy(arr.begin() + domain.l, arr.begin() + domain.r, values);
+      blocks_[bl].Pack(values);
+      int sum = 0;
+      for (int value : values)
+        sum += value;
+      tree_[v] = sum;
+    }
+    else
+    {
+      BuildTree(arr, bl, (bl + br) / 2, Left(v));
+      BuildTree(arr, (bl + br) / 2, br, Right(v));
+      UpdateValueFromBelow(v);
+    }
+  }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief Covered length of a set of intervals, under adding and removing
+ * intervals: the tree of the classic union-of-rectangles sweep.
+ *
+ * Leaf i is the elementary interval [breakpoints[i], breakpoints[i + 1]).
+ * Every node keeps how many added intervals cover it entirely, and the length
+ * of its domain covered by intervals in its subtree. Counts are never pushed
+ * down: an interval is only ever removed after being added, with the same
+ * domain, so it is removed from exactly the nodes it was added to.
+ */
+class CoverSegmentTree
+{
+public:
+  // Unit length leaves: leaf i is [i, i + 1).
+  CoverSegmentTree(int size)
+  {
+    std::vector<long long> breakpoints(size + 1);
+    for (int i = 0; i <= size; i++)
+      breakpoints[i] = i;
+    Init(breakpoints);
+  }
+
+  // breakpoints must be sorted; there are breakpoints.size() - 1 leaves.
+  CoverSegmentTree(const std::vector<long long> &breakpoints)
+  {
+    Init(breakpoints);
+  }
+
+  // Add the interval covering the leaves in domain.
+  void Add(Cube domain)
+  {
+    if (domain.Volume() > 0)
+      AddR(0, domain, {0, size()}, 1);
+  }
+
+  // Remove an interval previously added with the same domain.
+  void Remove(Cube domain)
+  {
+    if (domain.Volume() > 0)
+      AddR(0, domain, {0, size()}, -1);
+  }
+
+  // Length covered by at least one interval.
+  long long CoveredLength() { return covered_[0]; }
+
+  // Length of the leaves in domain covered by at least one interval.
+  long long CoveredLength(Cube domain)
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    return CoveredLengthR(0, domain, {0, size()});
+  }
+
+  int size() { return size_; }
+
+private:
+  int size_;
+  std::vector<long long> breakpoints_;
+
+  std::vector<int> count_;
+  std::vector<long long> covered_;
+
+  int Left(int v) { return 2 * v + 1; }
+  int Right(int v) { return 2 * v + 2; }
+
+  long long Length(Cube domain)
+  {
+    return breakpoints_[domain.r] - breakpoints_[domain.l];
+  }
+
+  void Init(const std::vector<long long> &breakpoints)
+  {
+    size_ = std::max(int(breakpoints.size()) - 1, 0);
+    breakpoints_ = breakpoints;
+    count_ = std::vector<int>(4 * size() + 1, 0);
+    covered_ = std::vector<long long>(4 * size() + 1, 0);
+  }
+
+  void UpdateValueFromBelow(int v, Cube domain)
+  {
+    if (count_[v] > 0)
+      covered_[v] = Length(domain);
+    else if (domain.IsPoint())
+      covered_[v] = 0;
+    else
+      covered_[v] = covered_[Left(v)] + covered_[Right(v)];
+  }
+
+  void AddR(int v, Cube query_domain, Cube node_domain, int delta)
+  {
+    if (query_domain == node_domain) // range covers this node.
+      count_[v] += delta;
+    else
+    {
+      auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+      if (!query_domain.IsDisjointFrom(left_node_domain))
+        AddR(Left(v), left_node_domain & query_domain, left_node_domain, delta);
+      if (!query_domain.IsDisjointFrom(right_node_domain))
+        AddR(Right(v), right_node_domain & query_domain, right_node_domain,
+             delta);
+    }
+    UpdateValueFromBelow(v, node_domain);
+  }
+
+  long long CoveredLengthR(int v, Cube query_domain, Cube node_domain)
+  {
+    if (count_[v] > 0)
+      return Length(query_domain);
+    if (query_domain == node_domain) // range covers this node.
+      return covered_[v];
+
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    long long covered = 0;
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      covered += CoveredLengthR(Left(v), left_node_domain & query_domain,
+                                left_node_domain);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      covered += CoveredLengthR(Right(v), right_node_domain & query_domain,
+                                right_node_domain);
+    return covered;
+  }
+};
+
+// The half-open box [x1, x2) x [y1, y2).
+struct Rectangle
+{
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+};
+
+/**
+ * @brief Area of the union of rectangles, in O(N log N): a sweep along x over
+ * a CoverSegmentTree of the distinct y coordinates.
+ */
+inline long long UnionArea(const std::vector<Rectangle> &rectangles)
+{
+  struct Event
+  {
+    int x;
+    // +1 when the rectangle starts, -1 when it ends.
+    int delta;
+    Cube domain;
+  };
+
+  std::vector<long long> ys;
+  ys.reserve(2 * rectangles.size());
+  for (const Rectangle &rect : rectangles)
+    if (rect.x1 < rect.x2 && rect.y1 < rect.y2)
+    {
+      ys.push_back(rect.y1);
+      ys.push_back(rect.y2);
+    }
+  std::sort(ys.begin(), ys.end());
+  ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+  auto Index = [&ys](int y)
+  { return int(std::lower_bound(ys.begin(), ys.end(), y) - ys.begin()); };
+
+  std::vector<Event> events;
+  events.reserve(2 * rectangles.size());
+  for (const Rectangle &rect : rectangles)
+    if (rect.x1 < rect.x2 && rect.y1 < rect.y2)
+    {
+      Cube domain = {Index(rect.y1), Index(rect.y2)};
+      events.push_back({rect.x1, 1, domain});
+      events.push_back({rect.x2, -1, domain});
+    }
+  std::sort(events.begin(), events.end(),
+            [](const Event &a, const Event &b) { return a.x < b.x; });
+
+  CoverSegmentTree tree(ys);
+  long long area = 0;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    if (i > 0)
+      area += tree.CoveredLength() * ((long long)events[i].x - events[i - 1].x);
+    if (events[i].delta > 0)
+      tree.Add(events[i].domain);
+    else
+      tree.Remove(events[i].domain);
+  }
+  return area;
+}
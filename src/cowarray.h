@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief A fixed-size array stored in 4KB pages which can be forked in
+ * O(pages) time. Forks share pages until one of them writes to a page, at
+ * which point the writer copies it.
+ *
+ * Every mutable access goes through the non-const operator[], so reads which
+ * should not claim a page must go through a const reference. Mutable accesses
+ * also mark their page dirty, until the next ClearDirty.
+ *
+ * Arrays are allocated in one block, and accessed as a flat array while
+ * they can be: reads while the pages are still contiguous, that is until a
+ * page is copied, and writes while every page is owned and dirty, as from
+ * construction until the first Fork or ClearDirty. Other accesses go
+ * through the page table.
+ */
+template <class T> class CowArray
+{
+public:
+  static constexpr int kPageBytes = 4096;
+  static constexpr int kPageShift = std::bit_width(kPageBytes / sizeof(T)) - 1;
+  static constexpr int kPageSize = 1 << kPageShift;
+  static constexpr int kPageMask = kPageSize - 1;
+
+  CowArray() = default;
+
+  CowArray(int size, const T &fill) : size_(size)
+  {
+    int num_pages = (size + kPageMask) >> kPageShift;
+    state_.assign(num_pages, kOwned | kDirty);
+    AllocateBlock(std::make_shared<T[]>(size_t(num_pages) << kPageShift, fill));
+  }
+
+  /**
+   * @brief An array over memory it does not own, such as a shared mapping.
+   * data must hold whole pages, and outlive the array. Forks copy pages out
+   * of it on write as usual.
+   */
+  CowArray(T *data, int size) : size_(size)
+  {
+    int num_pages = (size + kPageMask) >> kPageShift;
+    pages_.resize(num_pages);
+    data_.resize(num_pages);
+    state_.assign(num_pages, kOwned | kDirty);
+    for (int p = 0; p < num_pages; p++)
+      data_[p] = data + (size_t(p) << kPageShift);
+    base_ = writable_ = data;
+  }
+
+  /**
+   * @brief Like CowArray(size, fill), but every page starts out as one shared
+   * page of fill, which is copied on the first write to each page as after a
+   * Fork. Costs O(pages).
+   */
+  static CowArray Sparse(int size, const T &fill)
+  {
+    CowArray array;
+    array.size_ = size;
+    int num_pages = (size + kPageMask) >> kPageShift;
+    std::shared_ptr<T[]> page = std::make_shared<T[]>(kPageSize, fill);
+    array.pages_.assign(num_pages, page);
+    array.data_.assign(num_pages, page.get());
+    array.state_.assign(num_pages, kDirty);
+    array.slow_pages_ = num_pages;
+    return array;
+  }
+
+  // Copies are deep, into one block; use Fork to share pages.
+  CowArray(const CowArray &other) : size_(other.size_), state_(other.state_)
+  {
+    AllocateBlock(std::make_shared_for_overwrite<T[]>(
+        size_t(other.num_pages()) << kPageShift));
+    for (int p = 0; p < num_pages(); p++)
+      std::copy_n(other.data_[p], kPageSize, data_[p]);
+    for (uint8_t &state : state_)
+      state |= kOwned;
+    slow_pages_ = std::count(state_.begin(), state_.end(), kOwned);
+    writable_ = slow_pages_ == 0 ? base_ : nullptr;
+  }
+
+  CowArray &operator=(const CowArray &other)
+  {
+    if (this != &other)
+      *this = CowArray(other);
+    return *this;
+  }
+
+  CowArray(CowArray &&) = default;
+  CowArray &operator=(CowArray &&) = default;
+
+  const T &operator[](int i) const
+  {
+    if (base_)
+      return base_[i];
+    return data_[i >> kPageShift][i & kPageMask];
+  }
+
+  T &operator[](int i)
+  {
+    if (writable_)
+      return writable_[i];
+    int p = i >> kPageShift;
+    if (state_[p] != (kOwned | kDirty))
+      Touch(p);
+    return data_[p][i & kPageMask];
+  }
+
+  /**
+   * @brief Return an array sharing every page with this one. Both arrays copy
+   * a page the first time they write to it.
+   */
+  CowArray Fork()
+  {
+    CowArray child;
+    child.size_ = size_;
+    child.pages_ = pages_;
+    child.data_ = data_;
+    // Both inherit the dirty pages: they share the last checkpoint.
+    for (uint8_t &state : state_)
+      state &= ~kOwned;
+    child.state_ = state_;
+    child.base_ = base_;
+    writable_ = nullptr;
+    slow_pages_ = child.slow_pages_ = num_pages();
+    return child;
+  }
+
+  int size() const { return size_; }
+
+  int num_pages() const { return pages_.size(); }
+
+  const T *page(int p) const { return data_[p]; }
+
+  // Like operator[], claims page p and marks it dirty.
+  T *MutablePage(int p)
+  {
+    Touch(p);
+    return data_[p];
+  }
+
+  // Whether page p was written since the last ClearDirty.
+  bool IsDirty(int p) const { return state_[p] & kDirty; }
+
+  void ClearDirty()
+  {
+    for (uint8_t &state : state_)
+      state &= ~kDirty;
+    writable_ = nullptr;
+    slow_pages_ = num_pages();
+  }
+
+private:
+  // Bits of state_[p].
+  enum State : uint8_t
+  {
+    // The page is not shared with a fork.
+    kOwned = 1,
+    // The page was written since the last ClearDirty.
+    kDirty = 2,
+  };
+
+  int size_ = 0;
+  std::vector<std::shared_ptr<T[]>> pages_;
+  // data_[p] == pages_[p].get(), without the extra indirection.
+  std::vector<T *> data_;
+  std::vector<uint8_t> state_;
+
+  // data_[0] while data_[p] == data_[0] + p * kPageSize for every page, or
+  // null.
+  T *base_ = nullptr;
+  // base_ while every page is also owned and dirty, or null.
+  T *writable_ = nullptr;
+  // Pages not owned and dirty.
+  int slow_pages_ = 0;
+
+  // Make the pages slices of block, each with its own reference count.
+  void AllocateBlock(std::shared_ptr<T[]> block)
+  {
+    int num_pages = state_.size();
+    pages_.resize(num_pages);
+    data_.resize(num_pages);
+    for (int p = 0; p < num_pages; p++)
+    {
+      data_[p] = block.get() + (size_t(p) << kPageShift);
+      pages_[p] = std::shared_ptr<T[]>(data_[p], [block](T *) {});
+    }
+    base_ = writable_ = block.get();
+  }
+
+  void Touch(int p)
+  {
+    if (state_[p] == (kOwned | kDirty))
+      return;
+    if (!(state_[p] & kOwned))
+      Own(p, data_[p]);
+    state_[p] |= kDirty;
+    if (--slow_pages_ == 0)
+      writable_ = base_;
+  }
+
+  // Give page p a private copy of src.
+  void Own(int p, const T *src)
+  {
+    state_[p] |= kOwned;
+    // Every other fork has already let go of the page.
+    if (pages_[p] && pages_[p].use_count() == 1 && data_[p] == src)
+      return;
+    std::shared_ptr<T[]> page = std::make_shared_for_overwrite<T[]>(kPageSize);
+    std::copy_n(src, kPageSize, page.get());
+    pages_[p] = std::move(page);
+    data_[p] = pages_[p].get();
+    base_ = nullptr;
+  }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Blocking helpers around read(2)/write(2) and friends which retry short
+// transfers and throw on failure.
+
+inline void WriteFully(int fd, const void *buf, size_t count)
+{
+  const char *p = static_cast<const char *>(buf);
+  while (count > 0)
+  {
+    ssize_t n = ::write(fd, p, count);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "write");
+    }
+    p += n;
+    count -= n;
+  }
+}
+
+inline void ReadFully(int fd, void *buf, size_t count)
+{
+  char *p = static_cast<char *>(buf);
+  while (count > 0)
+  {
+    ssize_t n = ::read(fd, p, count);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "read");
+    }
+    if (n == 0)
+      throw std::runtime_error("read: unexpected end of file");
+    p += n;
+    count -= n;
+  }
+}
+
+// Like ReadFully, but returns the number of bytes read, which is less than
+// count only at end of file.
+inline size_t ReadUpTo(int fd, void *buf, size_t count)
+{
+  char *p = static_cast<char *>(buf);
+  size_t total = 0;
+  while (total < count)
+  {
+    ssize_t n = ::read(fd, p + total, count - total);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "read");
+    }
+    if (n == 0)
+      break;
+    total += n;
+  }
+  return total;
+}
+
+// Like ReadUpTo, but at offset, leaving the file position alone.
+inline size_t PreadUpTo(int fd, void *buf, size_t count, off_t offset)
+{
+  char *p = static_cast<char *>(buf);
+  size_t total = 0;
+  while (total < count)
+  {
+    ssize_t n = ::pread(fd, p + total, count - total, offset + total);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "pread");
+    }
+    if (n == 0)
+      break;
+    total += n;
+  }
+  return total;
+}
+
+inline void PwriteFully(int fd, const void *buf, size_t count, off_t offset)
+{
+  const char *p = static_cast<const char *>(buf);
+  while (count > 0)
+  {
+    ssize_t n = ::pwrite(fd, p, count, offset);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "pwrite");
+    }
+    p += n;
+    offset += n;
+    count -= n;
+  }
+}
+
+// Write every buffer of iov, in order.
+inline void WritevFully(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t n = ::writev(fd, iov, std::min(iovcnt, IOV_MAX));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "writev");
+    }
+    // Skip the buffers written in full, and trim a partially written one.
+    while (iovcnt > 0 && size_t(n) >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+// Fill every buffer of iov, in order, from offset on.
+inline void PreadvFully(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t n = ::preadv(fd, iov, std::min(iovcnt, IOV_MAX), offset);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "preadv");
+    }
+    if (n == 0)
+      throw std::runtime_error("preadv: unexpected end of file");
+    offset += n;
+    while (iovcnt > 0 && size_t(n) >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
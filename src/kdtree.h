@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "ndsegtree.h"
+
+/**
+ * @brief Weighted orthogonal range counting over a static set of points in
+ * n dimensions. Memory is linear in the number of points, however large the
+ * coordinates.
+ *
+ * A kd-tree over buckets of up to kLeafSize points, in the same implicit
+ * layout as NdSegmentTree with 2 children per node. Each node keeps the
+ * bounding box and total weight of its points, so a query adds whole nodes
+ * inside the query box and only scans the points of the leaves it cuts.
+ *
+ * Coordinates are 64-bit, so that spaces 2^32 or more wide are
+ * addressable; Box is the 64-bit counterpart of Cube<n>.
+ */
+template <int n> class KdTree
+{
+public:
+  static constexpr int kLeafSize = 32;
+
+  using Coord = int64_t;
+  using Point = std::array<Coord, n>;
+
+  // The half-open box [l, r).
+  struct Box
+  {
+    Point l;
+    Point r;
+  };
+
+  // weights defaults to 1 for every point.
+  KdTree(const std::vector<Point> &points, const std::vector<int> &weights = {})
+  {
+    size_ = points.size();
+    int num_nodes = 1;
+    while (num_nodes * kLeafSize < 2 * size_)
+      num_nodes *= 2;
+    nodes_ = std::vector<Node>(2 * num_nodes);
+
+    std::vector<Entry> entries(size_);
+    for (int i = 0; i < size_; i++)
+      entries[i] = {points[i], weights.empty() ? 1 : weights[i]};
+    if (size_ > 0)
+      BuildTree(entries, 0, size_, 0);
+
+    // Lay the points out by dimension, in leaf order, for the leaf scans.
+    for (int d = 0; d < n; d++)
+    {
+      coords_[d].resize(size_);
+      for (int i = 0; i < size_; i++)
+        coords_[d][i] = entries[i].point[d];
+    }
+    weights_.resize(size_);
+    for (int i = 0; i < size_; i++)
+      weights_[i] = entries[i].weight;
+    if (size_ > 0)
+      SumWeights(0, 0, size_);
+  }
+
+  // Total weight of the points inside domain.
+  long long QueryRange(const Box &domain) const
+  {
+    if (size_ == 0)
+      return 0;
+    return QueryRangeR(0, domain, 0, size_);
+  }
+
+  long long QueryRange(const Cube<n> &domain) const
+  {
+    Box box;
+    for (int d = 0; d < n; d++)
+      box.l[d] = domain.l[d], box.r[d] = domain.r[d];
+    return QueryRange(box);
+  }
+
+  int size() const { return size_; }
+
+private:
+  // Inclusive bounding box, so that coordinates up to INT64_MAX fit.
+  struct Node
+  {
+    Point lo;
+    Point hi;
+    long long weight = 0;
+  };
+
+  int size_;
+  std::vector<Node> nodes_;
+  std::array<std::vector<Coord>, n> coords_;
+  std::vector<int> weights_;
+
+  int Left(int v) const { return 2 * v + 1; }
+  int Right(int v) const { return 2 * v + 2; }
+
+  struct Entry
+  {
+    Point point;
+    int weight;
+  };
+
+  // Entries [l, r) form node v.
+  void BuildTree(std::vector<Entry> &entries, int l, int r, int v)
+  {
+    Node &node = nodes_[v];
+    node.lo = node.hi = entries[l].point;
+    for (int i = l + 1; i < r; i++)
+      for (int d = 0; d < n; d++)
+      {
+        node.lo[d] = std::min(node.lo[d], entries[i].point[d]);
+        node.hi[d] = std::max(node.hi[d], entries[i].point[d]);
+      }
+    if (r - l <= kLeafSize)
+      return;
+
+    // Split the widest dimension at the median. Widths are taken unsigned,
+    // since they may not fit in a Coord.
+    int split = 0;
+    for (int d = 1; d < n; d++)
+      if (uint64_t(node.hi[d]) - uint64_t(node.lo[d]) >
+          uint64_t(node.hi[split]) - uint64_t(node.lo[split]))
+        split = d;
+    int m = (l + r) / 2;
+    std::nth_element(entries.begin() + l, entries.begin() + m,
+                     entries.begin() + r,
+                     [split](const Entry &a, const Entry &b)
+                     { return a.point[split] < b.point[split]; });
+    BuildTree(entries, l, m, Left(v));
+    BuildTree(entries, m, r, Right(v));
+  }
+
+  long long SumWeights(int v, int l, int r)
+  {
+    long long sum = 0;
+    if (r - l <= kLeafSize)
+      for (int i = l; i < r; i++)
+        sum += weights_[i];
+    else
+      sum = SumWeights(Left(v), l, (l + r) / 2) +
+            SumWeights(Right(v), (l + r) / 2, r);
+    return nodes_[v].weight = sum;
+  }
+
+  long long QueryRangeR(int v, const Box &domain, int l, int r) const
+  {
+    const Node &node = nodes_[v];
+    bool inside = true;
+    for (int d = 0; d < n; d++)
+    {
+      if (node.hi[d] < domain.l[d] || node.lo[d] >= domain.r[d])
+        return 0;
+      inside &= domain.l[d] <= node.lo[d] && node.hi[d] < domain.r[d];
+    }
+    if (inside)
+      return node.weight;
+
+    if (r - l <= kLeafSize)
+      return ScanLeaf(domain, l, r);
+    return QueryRangeR(Left(v), domain, l, (l + r) / 2) +
+           QueryRangeR(Right(v), domain, (l + r) / 2, r);
+  }
+
+  // Branch free, so that the compiler vectorizes it.
+  long long ScanLeaf(const Box &domain, int l, int r) const
+  {
+    long long sum = 0;
+    for (int i = l; i < r; i++)
+    {
+      bool in = true;
+      for (int d = 0; d < n; d++)
+        in &= (coords_[d][i] >= domain.l[d]) & (coords_[d][i] < domain.r[d]);
+      sum += in ? weights_[i] : 0;
+    }
+    return sum;
+  }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "segtree.h"
+
+// The node type of MaxSegmentTree: every node holds the max of its range.
+struct MaxNode
+{
+  using Value = int;
+
+  static Value Empty() { return INT_MIN; }
+
+  static Value Leaf(int x) { return x; }
+
+  static Value Combine(Value a, Value b) { return std::max(a, b); }
+
+  // An operation moves the max of a domain like the value of one element.
+  static Value Apply(const Operation &op, Value max, Cube)
+  {
+    return op.Evaluate(max, {0, 1});
+  }
+};
+
+/**
+ * @brief A lazy segment tree like SegmentTree, aggregating by max instead of
+ * sum. Besides range max (INT_MIN over an empty range), it reports the k
+ * largest values of a range by best-first search.
+ */
+class MaxSegmentTree : public BasicSegmentTree<MaxNode>
+{
+public:
+  MaxSegmentTree(const std::vector<int> &arr) : BasicSegmentTree(arr) {}
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  /**
+   * @brief The (index, value) pairs of the k largest values in domain, by
+   * decreasing value.
+   *
+   * The nodes covering domain seed a heap keyed by node max; popping a leaf
+   * emits it, popping an internal node pushes its tag down and queues its
+   * children. So only O(k log n) nodes are expanded, rather than the whole
+   * range.
+   */
+  std::vector<std::pair<int, int>> TopK(Cube domain, int k)
+  {
+    std::vector<std::pair<int, int>> top;
+    if (k <= 0 || domain.Volume() <= 0)
+      return top;
+
+    heap_ = {};
+    SeedR(0, domain, {0, size()});
+    while (!heap_.empty() && int(top.size()) < k)
+    {
+      auto [max, v, node_domain] = heap_.top();
+      heap_.pop();
+      if (node_domain.IsPoint())
+      {
+        top.push_back({node_domain.l, max});
+        continue;
+      }
+      Push(v, node_domain);
+      auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+      heap_.push({Value(Left(v), left_node_domain), Left(v), left_node_domain});
+      heap_.push(
+          {Value(Right(v), right_node_domain), Right(v), right_node_domain});
+    }
+    return top;
+  }
+
+private:
+  // A node on TopK's frontier.
+  struct Frontier
+  {
+    int max;
+    int v;
+    Cube domain;
+
+    bool operator<(const Frontier &other) const { return max < other.max; }
+  };
+
+  std::priority_queue<Frontier> heap_;
+
+  // Queue the canonical nodes covering query_domain.
+  void SeedR(int v, Cube query_domain, Cube node_domain)
+  {
+    if (query_domain == node_domain)
+    {
+      heap_.push({Value(v, node_domain), v, node_domain});
+      return;
+    }
+
+    Push(v, node_domain);
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      SeedR(Left(v), left_node_domain.IntersectWith(query_domain),
+            left_node_domain);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      SeedR(Right(v), right_node_domain.IntersectWith(query_domain),
+            right_node_domain);
+  }
+};
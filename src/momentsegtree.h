@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#include "segtree.h"
+
+// The count, sum and sum of squares of a range of values.
+struct Moments
+{
+  long long count = 0;
+  long long sum = 0;
+  long long sum2 = 0;
+
+  Moments operator+(const Moments &other) const
+  {
+    return {count + other.count, sum + other.sum, sum2 + other.sum2};
+  }
+
+  // The moments after op is applied to every value.
+  Moments Evaluate(const Operation &op) const
+  {
+    long long a = op.to_add;
+    if (op.reset_pending)
+      return {count, a * count, a * a * count};
+    // (x + a)^2 = x^2 + 2ax + a^2, summed.
+    return {count, sum + a * count, sum2 + 2 * a * sum + a * a * count};
+  }
+
+  double Mean() const { return count == 0 ? 0 : double(sum) / count; }
+
+  // Population variance, or 0 if empty.
+  double Variance() const
+  {
+    if (count == 0)
+      return 0;
+    long double mean = (long double)sum / count;
+    return double((long double)sum2 / count - mean * mean);
+  }
+};
+
+// The node type of MomentSegmentTree.
+struct MomentsNode
+{
+  using Value = Moments;
+
+  static Value Empty() { return {}; }
+
+  static Value Leaf(int x) { return {1, x, (long long)x * x}; }
+
+  static Value Combine(const Value &a, const Value &b) { return a + b; }
+
+  static Value Apply(const Operation &op, const Value &value, Cube)
+  {
+    return value.Evaluate(op);
+  }
+};
+
+/**
+ * @brief A lazy segment tree like SegmentTree, aggregating the moments of
+ * its ranges instead of their sums, so that the mean and variance of any
+ * range are one descent. Range additions update the sum of squares in
+ * closed form, from the sum.
+ */
+class MomentSegmentTree : public BasicSegmentTree<MomentsNode>
+{
+public:
+  MomentSegmentTree(const std::vector<int> &arr) : BasicSegmentTree(arr) {}
+
+  double Variance(Cube domain) { return QueryRange(domain).Variance(); }
+
+  int Get(int i) { return QueryRange({i, i + 1}).sum; }
+};
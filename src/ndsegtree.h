@@ -1,4 +1,10 @@
+#pragma once
+
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <cassert>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -65,7 +71,7 @@ template <int n> struct Cube
   {
     // They only intersect if every interval intersects.
     for (int i = 0; i < n; i++)
-      if (other.l >= r | other.r <= l)
+      if ((other.l[i] >= r[i]) | (other.r[i] <= l[i]))
         return true;
 
     return false;
@@ -74,7 +80,7 @@ template <int n> struct Cube
   bool operator==(Cube<n> const &other) const
   {
     for (int i = 0; i < n; i++)
-      if (l[i] != other.l[i] | r[i] != other.r[i])
+      if ((l[i] != other.l[i]) | (r[i] != other.r[i]))
         return false;
 
     return true;
@@ -115,7 +121,7 @@ struct Operation
   bool reset_pending = false;
   int to_add = 0;
 
-  template <int n> int Evaluate(int val, Cube<n> domain)
+  template <int n> int Evaluate(int val, Cube<n> domain) const
   {
     if (reset_pending)
       return domain.Volume() * to_add;
@@ -136,6 +142,8 @@ struct Operation
     // object is zero <=> object is identity.
     memset(this, 0, sizeof(*this));
   }
+
+  bool IsIdentity() const { return !reset_pending && to_add == 0; }
 };
 
 template <int n> class NdSegmentTree
@@ -174,6 +182,16 @@ public:
     return QueryRangeR(0, domain, entire_domain_);
   }
 
+  /**
+   * @brief The sum over the box [0, r), anchored at the origin. Only the
+   * nodes straddling the faces of the box opposite the origin are split,
+   * and pending operations are applied on the way down instead of pushed.
+   */
+  int QueryPrefix(const std::array<int, n> &r)
+  {
+    return QueryPrefixR(0, r, entire_domain_, Operation());
+  }
+
   int Get(std::array<int, n> I)
   {
     Cube<n> domain;
@@ -184,6 +202,19 @@ public:
     return QueryRange(domain);
   }
 
+  /**
+   * @brief Call fn(I, value) for every nonzero value in domain, in
+   * O(k 2^n log V) for k such values. Requires every value to be
+   * non-negative, so that a zero sum proves a subtree empty: with negative
+   * values, the elements of a subtree summing to zero are skipped. Asserted
+   * on every node visited.
+   */
+  template <class Fn> void ForEachNonZero(Cube<n> domain, Fn &&fn)
+  {
+    if (!domain.IsEmpty())
+      ForEachNonZeroR(0, domain, entire_domain_, fn);
+  }
+
   const std::array<int, n> dims() const { return entire_domain_.r; }
 
 private:
@@ -207,42 +238,33 @@ private:
     tree_[v] = sum;
   }
 
-  // Recompute based on pending operations.
-  void UpdateValueFromAbove(int v, Cube<n> domain)
+  // Apply op to the (already up to date) value of v.
+  void UpdateValueFromAbove(int v, Cube<n> domain, const Operation &op)
   {
-    tree_[v] = operations_[v].template Evaluate<n>(tree_[v], domain);
+    tree_[v] = op.template Evaluate<n>(tree_[v], domain);
   }
 
-  // FIXME unclear functionality despite correctness.
+  /**
+   * @brief Apply op to node v. The value of v is updated immediately, and op
+   * is recorded as pending for the children of v (if there are any).
+   */
   void EvaluateAny(int v, Cube<n> domain, const Operation &op) // FIXME Rename.
   {
-    operations_[v].ComposeWith(op);
-    UpdateValueFromAbove(v, domain);
-    if (domain.IsPoint())
-      operations_[v].Reset();
+    UpdateValueFromAbove(v, domain, op);
+    if (!domain.IsPoint())
+      operations_[v].ComposeWith(op);
   }
 
   /**
-   * @brief Evaluate the operation for this node, push it onto its
-   * children, and reset the operation to the identity.
+   * @brief Apply the pending operation of this node to its children, and
+   * reset the operation to the identity.
    */
-  void Push(int v, const Cube<n> &domain, const std::array<Cube<n>, N> &quads)
+  void Push(int v, const std::array<Cube<n>, N> &quads)
   {
+    if (operations_[v].IsIdentity())
+      return;
     for (int i = 0; i < N; i++)
-    {
-      const Cube<n> quad = quads[i];
-      operations_[Child(v, i)].ComposeWith(operations_[v]);
-
-      // Evaluate leaves immediately.
-      if (quad.IsPoint())
-      {
-        UpdateValueFromAbove(Child(v, i), quad);
-        operations_[Child(v, i)].Reset();
-      }
-    }
-
-    // Recompute current value and clear the current operation.
-    UpdateValueFromAbove(v, domain);
+      EvaluateAny(Child(v, i), quads[i], operations_[v]);
     operations_[v].Reset();
   }
 
@@ -256,7 +278,7 @@ private:
     {
       const std::array<Cube<n>, N> quads = domain.Subdivide();
 
-      Push(v, domain, quads); // Defer current operation.
+      Push(v, quads); // Defer current operation.
 
       for (int i = 0; i < N; i++)
       {
@@ -281,7 +303,7 @@ private:
     {
       std::array<Cube<n>, N> quads = domain.Subdivide();
 
-      Push(v, domain, quads); // Defer overwrites.
+      Push(v, quads); // Defer overwrites.
 
       int sum = 0;
       for (int i = 0; i < N; i++)
@@ -297,18 +319,125 @@ private:
     }
   }
 
+  // pending is the composition of the pending operations of v's ancestors.
+  int QueryPrefixR(int v, const std::array<int, n> &r, const Cube<n> &domain,
+                   Operation pending)
+  {
+    if (domain.IsEmpty())
+      return 0;
+    bool inside = true;
+    for (int i = 0; i < n; i++)
+    {
+      if (domain.l[i] >= r[i]) // disjoint.
+        return 0;
+      inside &= domain.r[i] <= r[i];
+    }
+    if (inside)
+      return pending.template Evaluate<n>(tree_[v], domain);
+
+    Operation op = operations_[v];
+    op.ComposeWith(pending);
+    const std::array<Cube<n>, N> quads = domain.Subdivide();
+    int sum = 0;
+    for (int i = 0; i < N; i++)
+      sum += QueryPrefixR(Child(v, i), r, quads[i], op);
+    return sum;
+  }
+
+  template <class Fn>
+  void ForEachNonZeroR(int v, Cube<n> query_domain, Cube<n> domain, Fn &fn)
+  {
+    assert(tree_[v] >= 0);
+    if (tree_[v] == 0) // nothing below.
+      return;
+    if (domain.IsPoint())
+    {
+      fn(domain.l, tree_[v]);
+      return;
+    }
+
+    const std::array<Cube<n>, N> quads = domain.Subdivide();
+    Push(v, quads);
+    for (int i = 0; i < N; i++)
+    {
+      const Cube<n> query_sub = quads[i].IntersectWith(query_domain);
+      if (!query_sub.IsEmpty())
+        ForEachNonZeroR(Child(v, i), query_sub, quads[i], fn);
+    }
+  }
+
   void BuildTree(const std::vector<int> &arr)
   {
+    int side = dims()[0];
+    bool cube = std::has_single_bit(unsigned(side));
+    for (int i = 1; i < n; i++)
+      cube &= dims()[i] == side;
+    if (cube)
+    {
+      BuildLevels(arr, std::countr_zero(unsigned(side)));
+      return;
+    }
     // Build entire domain.
     Cube<n> domain = {std::array<int, n>(), dims()};
     BuildTreeR(arr, domain, 0);
   }
 
+  /**
+   * @brief Build the tree over a cube of side 2^depth bottom up. The tree is
+   * then complete, with the nodes at depth d numbered from
+   * (N^d - 1) / (N - 1) on, and the children of a node are consecutive, so
+   * every level is the sums of consecutive runs of N nodes of the level
+   * below: one streaming pass per level, in a loop the compiler can
+   * vectorize.
+   */
+  void BuildLevels(const std::vector<int> &arr, int depth)
+  {
+    int side = 1 << depth;
+    std::vector<int> first(depth + 1, 0);
+    for (int d = 1; d <= depth; d++)
+      first[d] = N * first[d - 1] + 1;
+
+    // The leaves are in Z-order: bit s of the position of a leaf in the
+    // bottom level is bit s / n of its coordinate in dimension s % n,
+    // inverted as the children with the bit set are the low halves.
+    // spread[k][c] is the contribution of coordinate c in dimension k.
+    std::array<std::vector<int>, n> spread;
+    for (int k = 0; k < n; k++)
+    {
+      spread[k].assign(side, 0);
+      for (int c = 0; c < side; c++)
+        for (int s = 0; s < depth; s++)
+          if (!((c >> s) & 1))
+            spread[k][c] |= 1 << (n * s + k);
+    }
+    for (int i = 0; i < int(arr.size()); i++)
+    {
+      // Linear has dimension 0 most significant.
+      int leaf = first[depth];
+      for (int k = 0; k < n; k++)
+        leaf += spread[k][(i >> (depth * (n - 1 - k))) & (side - 1)];
+      tree_[leaf] = arr[i];
+    }
+
+    for (int d = depth - 1; d >= 0; d--)
+    {
+      int *out = tree_.data() + first[d];
+      const int *in = tree_.data() + first[d + 1];
+      for (int j = 0; j < first[d + 1] - first[d]; j++)
+      {
+        int sum = 0;
+        for (int i = 0; i < N; i++)
+          sum += in[N * j + i];
+        out[j] = sum;
+      }
+    }
+  }
+
   int Linear(const std::array<int, n> &coords) const
   {
     int idx = coords.front();
     for (int i = 0; i < n - 1; i++)
-      idx = dims()[i] * idx + coords[i + 1];
+      idx = dims()[i + 1] * idx + coords[i + 1];
     return idx;
   }
 
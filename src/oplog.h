@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "fdio.h"
+
+/**
+ * @brief A SegmentTree which records every update in an append-only log, so
+ * that its exact state can be recovered from a checkpoint plus the log.
+ *
+ * Updates are applied immediately and buffered for the log. Commit makes
+ * them durable; concurrent committers share a single write and fdatasync
+ * (group commit).
+ *
+ * Every update gets a log sequence number (LSN), stored in its record. A
+ * checkpoint records the last LSN it includes, and replay skips the records
+ * up to it, so a crash between writing a checkpoint and emptying the log
+ * does not apply those updates twice.
+ */
+class LoggedSegmentTree
+{
+public:
+  // The tree is as of an empty log: log_fd is truncated.
+  LoggedSegmentTree(const std::vector<int> &arr, int log_fd)
+      : tree_(arr), log_fd_(log_fd)
+  {
+    TruncateLog();
+  }
+
+  LoggedSegmentTree(const LoggedSegmentTree &) = delete;
+  LoggedSegmentTree &operator=(const LoggedSegmentTree &) = delete;
+
+  /**
+   * @brief Rebuild the tree from a checkpoint written by Checkpoint and the
+   * log written since it was taken. A torn tail is cut off the log, and new
+   * updates are appended to it.
+   */
+  LoggedSegmentTree(int checkpoint_fd, int log_fd)
+      : LoggedSegmentTree(ReadCheckpointLsn(checkpoint_fd), checkpoint_fd,
+                          log_fd)
+  {
+  }
+
+  // The result of Replay.
+  struct ReplayResult
+  {
+    // Intact records read, applied or skipped.
+    uint64_t records = 0;
+    // LSN of the last update applied, or after if none was.
+    uint64_t lsn = 0;
+  };
+
+  /**
+   * @brief Apply every intact record of the log at fd with an LSN above
+   * after to tree, in batches. Stops at the first torn record, which can
+   * only be an uncommitted tail, or at a record whose LSN is not above the
+   * previous one.
+   */
+  static ReplayResult Replay(int fd, SegmentTree &tree, uint64_t after = 0)
+  {
+    std::vector<LogRecord> records(kReplayBatch);
+    std::vector<Update> batch;
+    ReplayResult result;
+    uint64_t last = 0;
+    result.lsn = after;
+    while (true)
+    {
+      size_t n = ReadUpTo(fd, records.data(), kReplayBatch * sizeof(LogRecord));
+      size_t intact = 0;
+      batch.clear();
+      for (; intact < n / sizeof(LogRecord); intact++)
+      {
+        const LogRecord &record = records[intact];
+        if (!record.IsIntact() || record.lsn <= last)
+          break;
+        last = record.lsn;
+        if (record.lsn > after)
+          batch.push_back(record.ToUpdate());
+      }
+      tree.ApplyBatch(batch);
+      result.records += intact;
+      result.lsn = std::max(result.lsn, last);
+      if (intact < kReplayBatch)
+        return result;
+    }
+  }
+
+  // Returns the log sequence number of the update, for Commit.
+  uint64_t ApplyToRange(Cube domain, const Operation &op)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tree_.ApplyToRange(domain, op);
+    pending_.push_back(LogRecord::FromUpdate({domain, op}, ++appended_));
+    return appended_;
+  }
+
+  uint64_t AssignRange(Cube domain, int val)
+  {
+    return ApplyToRange(domain, {true, val});
+  }
+
+  uint64_t AddToRange(Cube domain, int inc)
+  {
+    return ApplyToRange(domain, {false, inc});
+  }
+
+  int QueryRange(Cube domain)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tree_.QueryRange(domain);
+  }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  int size()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tree_.size();
+  }
+
+  /**
+   * @brief Block until every update up to lsn is durable.
+   * @throws std::invalid_argument if lsn was not returned by an update yet,
+   * as no commit could ever reach it.
+   * @throws std::system_error if the log cannot be written. The updates
+   * stay pending, and a later Commit retries them.
+   */
+  void Commit(uint64_t lsn)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (lsn > appended_)
+      throw std::invalid_argument("log: commit of an lsn not appended yet");
+    while (durable_ < lsn)
+    {
+      if (committing_)
+      {
+        committed_.wait(lock);
+        continue;
+      }
+
+      // Become the leader: write out everything pending so far, on behalf of
+      // every waiting committer.
+      committing_ = true;
+      uint64_t target = appended_;
+      std::swap(pending_, writing_);
+      lock.unlock();
+      try
+      {
+        PwriteFully(log_fd_, writing_.data(),
+                    writing_.size() * sizeof(LogRecord), log_size_);
+        if (::fdatasync(log_fd_) != 0)
+          throw std::system_error(errno, std::generic_category(),
+                                  "fdatasync");
+      }
+      catch (...)
+      {
+        // Hand the records back, ahead of those appended since, so that the
+        // next commit writes them again, over whatever part was written.
+        lock.lock();
+        writing_.insert(writing_.end(), pending_.begin(), pending_.end());
+        std::swap(pending_, writing_);
+        writing_.clear();
+        committing_ = false;
+        committed_.notify_all();
+        throw;
+      }
+      lock.lock();
+      log_size_ += writing_.size() * sizeof(LogRecord);
+      writing_.clear();
+      durable_ = target;
+      committing_ = false;
+      committed_.notify_all();
+    }
+  }
+
+  void Commit()
+  {
+    uint64_t lsn;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      lsn = appended_;
+    }
+    Commit(lsn);
+  }
+
+  /**
+   * @brief Write a full checkpoint of the tree, and the LSN of its last
+   * update, to checkpoint_fd and start an empty log. Recovery needs that
+   * checkpoint together with this log. Both are durable on return.
+   */
+  void Checkpoint(int checkpoint_fd)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    committed_.wait(lock, [this] { return !committing_; });
+    CheckpointLsn header = {kCheckpointLsnMagic, 0, appended_};
+    WriteFully(checkpoint_fd, &header, sizeof(header));
+    WriteCheckpoint(tree_, checkpoint_fd);
+    if (::fdatasync(checkpoint_fd) != 0)
+      throw std::system_error(errno, std::generic_category(), "fdatasync");
+    // Every update so far is durable in the checkpoint.
+    pending_.clear();
+    durable_ = appended_;
+    TruncateLog();
+    committed_.notify_all();
+  }
+
+private:
+  static constexpr size_t kReplayBatch = 1 << 16;
+
+  // Checkpoints written by Checkpoint start with a CheckpointLsn, followed
+  // by the tree's checkpoint (see checkpoint.h).
+  static constexpr uint32_t kCheckpointLsnMagic = 0x474c4c4a; // "JLLG"
+
+  struct CheckpointLsn
+  {
+    uint32_t magic;
+    uint32_t reserved;
+    // The last update included in the checkpoint.
+    uint64_t lsn;
+  };
+
+  // On-disk record, in native byte order. check guards against torn writes
+  // at the tail of the log, and carries the reset flag in its low bit. LSNs
+  // start at 1, and the checksum is seeded, so that a zero-filled tail is
+  // never intact.
+  struct LogRecord
+  {
+    int32_t l;
+    int32_t r;
+    int32_t to_add;
+    uint32_t check;
+    uint64_t lsn;
+
+    static uint32_t Checksum(int32_t l, int32_t r, int32_t to_add, bool reset,
+                             uint64_t lsn)
+    {
+      uint64_t h = 0x6a09e667f3bcc908ull;
+      h = (h ^ uint32_t(l)) * 0x9e3779b97f4a7c15ull;
+      h = (h ^ uint32_t(r)) * 0xbf58476d1ce4e5b9ull;
+      h = (h ^ uint32_t(to_add)) * 0x94d049bb133111ebull;
+      h = (h ^ lsn) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 31;
+      return (uint32_t(h) & ~1u) | reset;
+    }
+
+    static LogRecord FromUpdate(const Update &update, uint64_t lsn)
+    {
+      const auto [l, r] = update.domain;
+      const Operation &op = update.op;
+      return {l, r, op.to_add,
+              Checksum(l, r, op.to_add, op.reset_pending, lsn), lsn};
+    }
+
+    bool IsIntact() const
+    {
+      return lsn != 0 && check == Checksum(l, r, to_add, check & 1, lsn);
+    }
+
+    Update ToUpdate() const { return {{l, r}, {bool(check & 1), to_add}}; }
+  };
+
+  SegmentTree tree_;
+  int log_fd_;
+
+  // Guards everything below, and tree_.
+  std::mutex mutex_;
+  std::condition_variable committed_;
+  // Records appended but not yet handed to a committer.
+  std::vector<LogRecord> pending_;
+  // Records being written by the current committer.
+  std::vector<LogRecord> writing_;
+  bool committing_ = false;
+  uint64_t appended_ = 0;
+  uint64_t durable_ = 0;
+  // Bytes of durable records in the log, where the next commit writes.
+  off_t log_size_ = 0;
+
+  LoggedSegmentTree(uint64_t checkpoint_lsn, int checkpoint_fd, int log_fd)
+      : tree_(RestoreCheckpoint(checkpoint_fd)), log_fd_(log_fd)
+  {
+    if (::lseek(log_fd_, 0, SEEK_SET) != 0)
+      throw std::system_error(errno, std::generic_category(), "lseek");
+    ReplayResult replayed = Replay(log_fd_, tree_, checkpoint_lsn);
+    durable_ = appended_ = replayed.lsn;
+    TruncateLog(replayed.records * sizeof(LogRecord));
+  }
+
+  static uint64_t ReadCheckpointLsn(int checkpoint_fd)
+  {
+    CheckpointLsn header;
+    ReadFully(checkpoint_fd, &header, sizeof(header));
+    if (header.magic != kCheckpointLsnMagic)
+      throw std::runtime_error("log: bad checkpoint magic");
+    return header.lsn;
+  }
+
+  // Cut the log to size bytes, durably.
+  void TruncateLog(off_t size = 0)
+  {
+    if (::ftruncate(log_fd_, size) != 0)
+      throw std::system_error(errno, std::generic_category(), "truncate log");
+    if (::fsync(log_fd_) != 0)
+      throw std::system_error(errno, std::generic_category(), "fsync");
+    log_size_ = size;
+  }
+};
@@ -0,0 +1,697 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fdio.h"
+#include "segtree.h"
+
+/**
+ * @brief A SegmentTree kept in a file, for arrays larger than memory, with a
+ * fixed-size CLOCK buffer pool of pages in front of it.
+ *
+ * The binary tree is cut into pages of page_height levels from the leaves
+ * up, so a page holds a whole subtree and has fanout = 2^page_height child
+ * pages, and a root-to-leaf path crosses O(log_B n) pages. Only the root
+ * page may have fewer levels: cut from the root down, the last levels would
+ * get a page per node. Pages are numbered level by level, and stored in that
+ * order after the header, which takes a page. Pages never written are
+ * holes, read as zeros: a zero tree, since a zero Operation is the
+ * identity.
+ *
+ * With Layout::kDirect, updates push tags down as SegmentTree does, at the
+ * cost of a random read per page level. Queries do not: they carry the
+ * pending tags down instead, so they only read the pages on their two
+ * boundary paths.
+ *
+ * With Layout::kBuffered, each page with child pages also has a buffer of
+ * updates for them (a buffer tree); the pages of the leaves have none. An
+ * add, or a tag pushed out of a page, stops at the page's bottom level and
+ * is appended to the buffer, and a full buffer is flushed down for the
+ * child page with the most pending updates, in one read and write of that
+ * page. Adds cost amortized
+ * O((1/B) log_B n) I/Os. The sums of a page stay exact, since the effect of
+ * an add on a sum does not depend on the values below. A partial assign has
+ * no such shortcut, and is applied down to the leaves as with kDirect, as
+ * are queries: both first flush the pending updates of every child page
+ * they enter.
+ *
+ * Element indices and sums are 64-bit, so that arrays of more than 2^31
+ * elements fit; Domain is the 64-bit counterpart of Cube.
+ *
+ * Modified pages are written back when evicted, by Flush, and on
+ * destruction. The caller owns fd.
+ */
+class PagedSegmentTree
+{
+public:
+  // The half-open range of elements [l, r).
+  struct Domain
+  {
+    int64_t l;
+    int64_t r;
+
+    Domain() = default;
+    Domain(int64_t l, int64_t r) : l(l), r(r) {}
+    Domain(Cube cube) : l(cube.l), r(cube.r) {}
+
+    int64_t Volume() const { return r - l; }
+
+    bool IsPoint() const { return Volume() == 1; }
+
+    std::pair<Domain, Domain> Subdivide() const
+    {
+      int64_t m = (l + r) / 2;
+      return {{l, m}, {m, r}};
+    }
+
+    bool IsDisjointFrom(const Domain &other) const
+    {
+      return (other.l >= r) | (other.r <= l);
+    }
+
+    bool operator==(const Domain &) const = default;
+
+    Domain operator&(const Domain &other) const
+    {
+      return {std::max(l, other.l), std::min(r, other.r)};
+    }
+  };
+
+  struct Layout
+  {
+    // Levels of the binary tree per page.
+    int page_height;
+    // Updates per page buffer, or 0 for none.
+    int buffer_capacity;
+
+    // 4KB pages.
+    static const Layout kDirect;
+    // 16KB pages of 32 children.
+    static const Layout kBuffered;
+  };
+
+  static constexpr int kDefaultPoolPages = 1024;
+
+  // A tree of size zeros, in fd, which is truncated first.
+  PagedSegmentTree(int fd, int64_t size, int pool_pages = kDefaultPoolPages,
+                   Layout layout = Layout::kDirect)
+      : fd_(fd)
+  {
+    Create(size, pool_pages, layout);
+  }
+
+  // A tree of arr, in fd, which is truncated first.
+  PagedSegmentTree(int fd, const std::vector<int> &arr,
+                   int pool_pages = kDefaultPoolPages,
+                   Layout layout = Layout::kDirect)
+      : fd_(fd)
+  {
+    Create(arr.size(), pool_pages, layout);
+    if (size() > 0)
+    {
+      NodeRef root = Root();
+      BuildTree(arr, root, {0, size()});
+      Release(root);
+    }
+  }
+
+  PagedSegmentTree(PagedSegmentTree &&) = default;
+
+  // Flushes, ignoring errors: call Flush first to see them.
+  ~PagedSegmentTree()
+  {
+    try
+    {
+      Flush();
+    }
+    catch (const std::system_error &)
+    {
+    }
+  }
+
+  /**
+   * @brief Open the tree written to fd by a flushed PagedSegmentTree.
+   * @throws std::runtime_error if fd does not hold a compatible tree.
+   */
+  static PagedSegmentTree Open(int fd, int pool_pages = kDefaultPoolPages)
+  {
+    Header header;
+    if (PreadUpTo(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != kMagic || header.size < 0 ||
+        header.page_height < 1 || header.page_height > 16 ||
+        header.buffer_capacity < 0)
+      throw std::runtime_error("paged tree: bad or incompatible file");
+    PagedSegmentTree tree(fd);
+    tree.size_ = header.size;
+    tree.SetLayout({header.page_height, header.buffer_capacity});
+    if (header.page_bytes != uint32_t(tree.page_bytes_))
+      throw std::runtime_error("paged tree: bad or incompatible file");
+    tree.AllocatePool(pool_pages);
+    return tree;
+  }
+
+  void ApplyToRange(Domain domain, const Operation &op)
+  {
+    if (domain.Volume() <= 0)
+      return;
+    NodeRef root = Root();
+    ApplyOperationR(root, domain, {0, size()}, op);
+    Release(root);
+  }
+
+  void AssignRange(Domain domain, int val)
+  {
+    ApplyToRange(domain, {true, val});
+  }
+
+  void AddToRange(Domain domain, int inc)
+  {
+    ApplyToRange(domain, {false, inc});
+  }
+
+  int64_t QueryRange(Domain domain)
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    NodeRef root = Root();
+    int64_t sum = QueryRangeR(root, domain, {0, size()}, Operation());
+    Release(root);
+    return sum;
+  }
+
+  int64_t Get(int64_t i) { return QueryRange({i, i + 1}); }
+
+  // Write every modified page back to the file.
+  void Flush()
+  {
+    for (Frame &frame : frames_)
+      if (frame.dirty)
+        WriteBack(frame);
+  }
+
+  int64_t size() { return size_; }
+
+  // Pages read from and written to the file so far.
+  uint64_t page_reads() const { return page_reads_; }
+  uint64_t page_writes() const { return page_writes_; }
+
+private:
+  static constexpr uint32_t kMagic = 0x3453504a; // "JPS4"
+
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t page_bytes;
+    int32_t page_height;
+    int32_t buffer_capacity;
+    int64_t size;
+  };
+
+  struct Node
+  {
+    int64_t value;
+    Operation operation;
+  };
+
+  // A buffered update of the child page child of a page.
+  struct Entry
+  {
+    Domain domain;
+    Operation op;
+    int child;
+  };
+
+  // A page is its nodes, the number of buffered entries (in 8 bytes, to keep
+  // the entries aligned), and the entries.
+  struct Frame
+  {
+    int64_t page = -1;
+    int pins = 0;
+    bool dirty = false;
+    // Cleared by the CLOCK hand, set on every use.
+    bool referenced = false;
+    std::unique_ptr<char[]> data;
+  };
+
+  // A node, with its page pinned in the pool until Release.
+  struct NodeRef
+  {
+    int frame;
+    int64_t page;
+    int index;
+  };
+
+  int fd_;
+  int64_t size_ = 0;
+
+  int page_height_;
+  int fanout_;
+  int page_nodes_;
+  int buffer_capacity_;
+  int page_bytes_;
+  // The pages of the leaves, the last level of pages from first_leaf_page_
+  // on, have no buffer, and leaf_height_ levels in leaf_page_bytes_.
+  int leaf_height_;
+  int leaf_page_bytes_;
+  int64_t first_leaf_page_;
+  // Levels of the root page, at most page_height_, or leaf_height_ if it is
+  // the only page.
+  int top_height_;
+
+  std::vector<Frame> frames_;
+  std::unordered_map<int64_t, int> frame_of_;
+  int clock_hand_ = 0;
+
+  uint64_t page_reads_ = 0;
+  uint64_t page_writes_ = 0;
+
+  PagedSegmentTree(int fd) : fd_(fd) {}
+
+  void SetLayout(Layout layout)
+  {
+    page_height_ = layout.page_height;
+    fanout_ = 1 << page_height_;
+    page_nodes_ = fanout_ - 1;
+    buffer_capacity_ = layout.buffer_capacity;
+    int bytes = page_nodes_ * sizeof(Node) + sizeof(int64_t) +
+                buffer_capacity_ * sizeof(Entry);
+    page_bytes_ = (bytes + 4095) / 4096 * 4096;
+    // Without a buffer, the pages of the leaves fit more levels.
+    leaf_height_ = page_height_;
+    while (((2 << leaf_height_) - 1) * sizeof(Node) <= 4096)
+      leaf_height_++;
+    leaf_page_bytes_ =
+        (((1 << leaf_height_) - 1) * sizeof(Node) + 4095) / 4096 * 4096;
+
+    // A tree over n elements has ceil(log2 n) + 1 levels: the last
+    // leaf_height_ go to the pages of the leaves, and the rest to pages of
+    // page_height_ levels, and to the root page.
+    int levels = 1;
+    for (int64_t span = 1; span < size_; span *= 2)
+      levels++;
+    first_leaf_page_ = 0;
+    if (levels <= leaf_height_)
+    {
+      top_height_ = levels;
+      return;
+    }
+    int rest = levels - leaf_height_;
+    top_height_ = (rest - 1) % page_height_ + 1;
+    for (int64_t level = 0, level_pages = 1;
+         level < (rest - top_height_) / page_height_ + 1; level++)
+    {
+      first_leaf_page_ += level_pages;
+      level_pages *= level == 0 ? int64_t(1) << top_height_ : fanout_;
+    }
+  }
+
+  void Create(int64_t size, int pool_pages, Layout layout)
+  {
+    size_ = size;
+    SetLayout(layout);
+    if (::ftruncate(fd_, 0) != 0)
+      throw std::system_error(errno, std::generic_category(), "ftruncate");
+    Header header = {kMagic, uint32_t(page_bytes_), page_height_,
+                     buffer_capacity_, size};
+    PwriteFully(fd_, &header, sizeof(header), 0);
+    AllocatePool(pool_pages);
+  }
+
+  void AllocatePool(int pool_pages)
+  {
+    // Enough for the pages pinned along a path, and flushes cascading down.
+    frames_ = std::vector<Frame>(std::max(pool_pages, 64));
+    for (Frame &frame : frames_)
+      frame.data =
+          std::make_unique<char[]>(std::max(page_bytes_, leaf_page_bytes_));
+    frame_of_.reserve(frames_.size());
+  }
+
+  int PageBytes(int64_t page)
+  {
+    return page < first_leaf_page_ ? page_bytes_ : leaf_page_bytes_;
+  }
+
+  off_t Offset(int64_t page)
+  {
+    if (page < first_leaf_page_)
+      return (page + 1) * off_t(page_bytes_);
+    return (first_leaf_page_ + 1) * off_t(page_bytes_) +
+           (page - first_leaf_page_) * off_t(leaf_page_bytes_);
+  }
+
+  Node *Nodes(int frame)
+  {
+    return reinterpret_cast<Node *>(frames_[frame].data.get());
+  }
+
+  int32_t &BufferSize(int frame)
+  {
+    return *reinterpret_cast<int32_t *>(frames_[frame].data.get() +
+                                        page_nodes_ * sizeof(Node));
+  }
+
+  Entry *Buffer(int frame)
+  {
+    return reinterpret_cast<Entry *>(frames_[frame].data.get() +
+                                     page_nodes_ * sizeof(Node) +
+                                     sizeof(int64_t));
+  }
+
+  void WriteBack(Frame &frame)
+  {
+    PwriteFully(fd_, frame.data.get(), PageBytes(frame.page),
+                Offset(frame.page));
+    frame.dirty = false;
+    page_writes_++;
+  }
+
+  // Pin page in the pool, reading it in if needed, with CLOCK replacement.
+  int Pin(int64_t page)
+  {
+    if (auto it = frame_of_.find(page); it != frame_of_.end())
+    {
+      Frame &frame = frames_[it->second];
+      frame.pins++;
+      frame.referenced = true;
+      return it->second;
+    }
+
+    for (size_t scanned = 0;; scanned++)
+    {
+      Frame &frame = frames_[clock_hand_];
+      if (frame.pins == 0 && !frame.referenced)
+        break;
+      if (scanned == 2 * frames_.size())
+        throw std::runtime_error("paged tree: every page is pinned");
+      frame.referenced = false;
+      clock_hand_ = (clock_hand_ + 1) % frames_.size();
+    }
+    int f = clock_hand_;
+    clock_hand_ = (clock_hand_ + 1) % frames_.size();
+
+    Frame &frame = frames_[f];
+    if (frame.page >= 0)
+    {
+      if (frame.dirty)
+        WriteBack(frame);
+      frame_of_.erase(frame.page);
+    }
+    size_t n =
+        PreadUpTo(fd_, frame.data.get(), PageBytes(page), Offset(page));
+    std::memset(frame.data.get() + n, 0, PageBytes(page) - n);
+    page_reads_++;
+    frame.page = page;
+    frame.pins = 1;
+    frame.referenced = true;
+    frame_of_[page] = f;
+    return f;
+  }
+
+  NodeRef Root() { return {Pin(0), 0, 0}; }
+
+  int Height(int64_t page)
+  {
+    if (page == 0)
+      return top_height_;
+    return page < first_leaf_page_ ? page_height_ : leaf_height_;
+  }
+
+  // Nodes of page from here on are on its bottom level.
+  int FirstBottom(int64_t page) { return (1 << (Height(page) - 1)) - 1; }
+
+  bool IsBottom(NodeRef ref) { return ref.index >= FirstBottom(ref.page); }
+
+  // The index, among its page's children, of the page of a child of the
+  // bottom node ref. side is 0 for the left child, 1 for the right one.
+  int ChildPage(NodeRef ref, int side)
+  {
+    return 2 * (ref.index - FirstBottom(ref.page)) + side;
+  }
+
+  // Child page child of page: the root page's children come first, then
+  // the fanout_ children of each page in turn.
+  int64_t ChildOf(int64_t page, int child)
+  {
+    if (page == 0)
+      return 1 + child;
+    return 1 + (int64_t(1) << top_height_) + (page - 1) * fanout_ + child;
+  }
+
+  NodeRef Child(NodeRef ref, int side)
+  {
+    if (!IsBottom(ref))
+    {
+      frames_[ref.frame].pins++;
+      return {ref.frame, ref.page, 2 * ref.index + 1 + side};
+    }
+    int64_t page = ChildOf(ref.page, ChildPage(ref, side));
+    return {Pin(page), page, 0};
+  }
+
+  // Like Child, but first applies the updates buffered for the child's page.
+  NodeRef FlushedChild(NodeRef ref, Domain child_domain, int side)
+  {
+    if (IsBottom(ref) && buffer_capacity_ > 0)
+      FlushChild(ref.frame, ref.page, ChildPage(ref, side), child_domain);
+    return Child(ref, side);
+  }
+
+  void Release(NodeRef ref) { frames_[ref.frame].pins--; }
+
+  Node &At(NodeRef ref) { return Nodes(ref.frame)[ref.index]; }
+
+  Node &Modify(NodeRef ref)
+  {
+    frames_[ref.frame].dirty = true;
+    return At(ref);
+  }
+
+  // The domain of the root of page, found by walking down to it.
+  Domain PageDomain(int64_t page)
+  {
+    if (page == 0)
+      return {0, size()};
+    // Invert ChildOf.
+    int64_t top_fanout = int64_t(1) << top_height_, parent = 0;
+    int child = page - 1;
+    if (page > top_fanout)
+    {
+      parent = (page - 1 - top_fanout) / fanout_ + 1;
+      child = (page - 1 - top_fanout) % fanout_;
+    }
+    Domain domain = PageDomain(parent);
+    // The path from the parent's root to the bottom node above child, then
+    // to child: one step per level of the parent, most significant first.
+    int path = (child / 2 + FirstBottom(parent) + 1) * 2 + child % 2;
+    for (int bit = Height(parent) - 1; bit >= 0; bit--)
+    {
+      auto [left_domain, right_domain] = domain.Subdivide();
+      domain = (path >> bit & 1) ? right_domain : left_domain;
+    }
+    return domain;
+  }
+
+  // Append an update for child page child of page, which is pinned in frame.
+  void Append(int frame, int64_t page, int child, Domain domain,
+              const Operation &op)
+  {
+    if (BufferSize(frame) == buffer_capacity_)
+      FlushLargest(frame, page);
+    Buffer(frame)[BufferSize(frame)++] = {domain, op, child};
+    frames_[frame].dirty = true;
+  }
+
+  void FlushLargest(int frame, int64_t page)
+  {
+    std::vector<int> counts(fanout_, 0);
+    for (int i = 0; i < BufferSize(frame); i++)
+      counts[Buffer(frame)[i].child]++;
+    int child = std::max_element(counts.begin(), counts.end()) - counts.begin();
+    int64_t child_page = ChildOf(page, child);
+    FlushChild(frame, page, child, PageDomain(child_page));
+  }
+
+  // Apply the updates buffered in page (pinned in frame) for its child page
+  // child, whose root has domain child_domain, in order.
+  void FlushChild(int frame, int64_t page, int child, Domain child_domain)
+  {
+    std::vector<Entry> flushed;
+    Entry *buffer = Buffer(frame);
+    int kept = 0;
+    for (int i = 0; i < BufferSize(frame); i++)
+      if (buffer[i].child == child)
+        flushed.push_back(buffer[i]);
+      else
+        buffer[kept++] = buffer[i];
+    if (flushed.empty())
+      return;
+    BufferSize(frame) = kept;
+    frames_[frame].dirty = true;
+
+    int64_t child_page = ChildOf(page, child);
+    NodeRef root = {Pin(child_page), child_page, 0};
+    for (const Entry &entry : flushed)
+      ApplyOperationR(root, entry.domain, child_domain, entry.op);
+    Release(root);
+  }
+
+  // Operation::Evaluate, in 64 bits.
+  static int64_t Evaluate(const Operation &op, int64_t value, Domain domain)
+  {
+    int64_t applied = domain.Volume() * op.to_add;
+    return op.reset_pending ? applied : value + applied;
+  }
+
+  void EvaluateAny(NodeRef ref, Domain domain, const Operation &op)
+  {
+    Node &node = Modify(ref);
+    node.value = Evaluate(op, node.value, domain);
+    if (!domain.IsPoint())
+      node.operation.ComposeWith(op);
+  }
+
+  void Push(NodeRef ref, Domain domain)
+  {
+    if (At(ref).operation.IsIdentity())
+      return;
+    Operation op = At(ref).operation;
+    auto [left_domain, right_domain] = domain.Subdivide();
+    if (IsBottom(ref) && buffer_capacity_ > 0)
+    {
+      Append(ref.frame, ref.page, ChildPage(ref, 0), left_domain, op);
+      Append(ref.frame, ref.page, ChildPage(ref, 1), right_domain, op);
+    }
+    else
+    {
+      NodeRef left = Child(ref, 0);
+      EvaluateAny(left, left_domain, op);
+      Release(left);
+      NodeRef right = Child(ref, 1);
+      EvaluateAny(right, right_domain, op);
+      Release(right);
+    }
+    Modify(ref).operation.Reset();
+  }
+
+  void ApplyOperationR(NodeRef ref, Domain query_domain, Domain node_domain,
+                       const Operation &op)
+  {
+    if (query_domain == node_domain) // range covers this node.
+    {
+      EvaluateAny(ref, node_domain, op);
+      return;
+    }
+
+    Push(ref, node_domain);
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    if (IsBottom(ref) && buffer_capacity_ > 0)
+    {
+      ApplyAtBottom(ref, query_domain, node_domain, op);
+      return;
+    }
+
+    NodeRef left = Child(ref, 0);
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      ApplyOperationR(left, left_node_domain & query_domain, left_node_domain,
+                      op);
+    NodeRef right = Child(ref, 1);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      ApplyOperationR(right, right_node_domain & query_domain,
+                      right_node_domain, op);
+    Modify(ref).value = At(left).value + At(right).value;
+    Release(left);
+    Release(right);
+  }
+
+  // Apply op to the part of the child pages of the bottom node ref within
+  // query_domain, which ref does not cover. ref's tag is pushed already.
+  void ApplyAtBottom(NodeRef ref, Domain query_domain, Domain node_domain,
+                     const Operation &op)
+  {
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    Domain child_domains[2] = {left_node_domain, right_node_domain};
+    for (int side = 0; side < 2; side++)
+    {
+      Domain child_domain = child_domains[side];
+      if (query_domain.IsDisjointFrom(child_domain))
+        continue;
+      if (!op.reset_pending)
+      {
+        Append(ref.frame, ref.page, ChildPage(ref, side),
+               child_domain & query_domain, op);
+        continue;
+      }
+      // The new sum depends on the values below.
+      NodeRef child = FlushedChild(ref, child_domain, side);
+      int64_t old_value = At(child).value;
+      ApplyOperationR(child, child_domain & query_domain, child_domain, op);
+      Modify(ref).value += At(child).value - old_value;
+      Release(child);
+    }
+    if (!op.reset_pending)
+      Modify(ref).value = Evaluate(op, At(ref).value, query_domain);
+  }
+
+  // above is the composition of the pending tags of ref's ancestors, which
+  // have not been pushed to it.
+  int64_t QueryRangeR(NodeRef ref, Domain query_domain, Domain node_domain,
+                      const Operation &above)
+  {
+    if (query_domain == node_domain) // range covers this node.
+      return Evaluate(above, At(ref).value, node_domain);
+
+    Operation pending = At(ref).operation;
+    pending.ComposeWith(above);
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    int64_t sum = 0;
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+    {
+      NodeRef left = FlushedChild(ref, left_node_domain, 0);
+      sum += QueryRangeR(left, left_node_domain & query_domain,
+                         left_node_domain, pending);
+      Release(left);
+    }
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+    {
+      NodeRef right = FlushedChild(ref, right_node_domain, 1);
+      sum += QueryRangeR(right, right_node_domain & query_domain,
+                         right_node_domain, pending);
+      Release(right);
+    }
+    return sum;
+  }
+
+  void BuildTree(const std::vector<int> &arr, NodeRef ref, Domain domain)
+  {
+    if (domain.IsPoint())
+    {
+      Modify(ref).value = arr[domain.l];
+      return;
+    }
+    auto [left_domain, right_domain] = domain.Subdivide();
+    NodeRef left = Child(ref, 0);
+    BuildTree(arr, left, left_domain);
+    NodeRef right = Child(ref, 1);
+    BuildTree(arr, right, right_domain);
+    Modify(ref).value = At(left).value + At(right).value;
+    Release(left);
+    Release(right);
+  }
+};
+
+inline const PagedSegmentTree::Layout PagedSegmentTree::Layout::kDirect = {8,
+                                                                            0};
+inline const PagedSegmentTree::Layout PagedSegmentTree::Layout::kBuffered = {
+    5, 496};
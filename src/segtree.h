@@ -1,23 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <utility>
 #include <vector>
 
+#include "cowarray.h"
+
 struct Cube
 {
   int l;
   int r;
 
-  int Volume() { return r - l; }
+  int Volume() const { return r - l; }
 
-  int Center() { return (r + l) / 2; }
+  int Center() const { return (r + l) / 2; }
 
-  std::pair<Cube, Cube> Subdivide()
+  std::pair<Cube, Cube> Subdivide() const
   {
     int m = Center();
     return {{l, m}, {m, r}};
   }
 
-  bool IsPoint() { return Volume() == 1; }
+  bool IsPoint() const { return Volume() == 1; }
 
-  bool IsDisjointFrom(const Cube &other) { return other.l >= r | other.r <= l; }
+  bool IsDisjointFrom(const Cube &other) const
+  {
+    return (other.l >= r) | (other.r <= l);
+  }
 
   bool operator==(Cube const &) const = default;
 
@@ -32,12 +50,13 @@ struct Cube
   }
 };
 
-struct Operation
+// Aligned to its size, so that it can be stored atomically (see Store).
+struct alignas(8) Operation
 {
   bool reset_pending = false;
   int to_add = 0;
 
-  int Evaluate(int val, Cube domain)
+  int Evaluate(int val, Cube domain) const
   {
     if (reset_pending)
       return domain.Volume() * to_add;
@@ -58,41 +77,410 @@ struct Operation
     // object is zero <=> object is identity.
     memset(this, 0, sizeof(*this));
   }
+
+  bool IsIdentity() const { return !reset_pending && to_add == 0; }
 };
 
-class SegmentTree
+// A single range update, as consumed by SegmentTree::ApplyBatch.
+struct Update
+{
+  Cube domain;
+  Operation op;
+};
+
+// An update, or a query, as consumed by SegmentTree::ExecuteOrdered.
+struct Op
+{
+  Cube domain;
+  // Ignored by queries.
+  Operation op;
+  bool is_query = false;
+  // The sum over domain, set by ExecuteOrdered for queries.
+  int result = 0;
+};
+
+/**
+ * @brief The node type of SegmentTree: every node holds the sum of its range.
+ *
+ * A node type defines the Value of a range, the Value of an empty range and
+ * of a single element, how the Values of two adjacent ranges combine, and
+ * how an Operation applied to every element of a range moves its Value.
+ */
+struct SumNode
+{
+  using Value = int;
+
+  static Value Empty() { return 0; }
+
+  static Value Leaf(int x) { return x; }
+
+  static Value Combine(Value a, Value b) { return a + b; }
+
+  static Value Apply(const Operation &op, Value value, Cube domain)
+  {
+    return op.Evaluate(value, domain);
+  }
+};
+
+/**
+ * @brief A lazy segment tree aggregating the Values of Node (see SumNode)
+ * under range assignments and additions. The traversals are shared by every
+ * node type; the point updates and queries which rely on sums are only
+ * available on SegmentTree. Trees with queries of their own derive from this
+ * (see maxsegtree.h).
+ */
+template <class Node> class BasicSegmentTree
 {
 public:
-  SegmentTree(const std::vector<int> &arr)
+  using ValueType = typename Node::Value;
+
+  BasicSegmentTree(const std::vector<int> &arr)
   {
-    size_ = arr.size();
-    int tree_size = 4 * size() + 1;
-    tree_ = std::vector<int>(tree_size, 0);
-    operations_ = std::vector<Operation>(tree_size, Operation());
+    Allocate(arr.size());
     // Construct the segment tree.
-    BuildTree(arr, 0, arr.size(), 0);
+    if (std::has_single_bit(arr.size()))
+      BuildLevels(arr);
+    else if (!arr.empty())
+      BuildTree(arr, 0, arr.size(), 0);
+  }
+
+  /**
+   * @brief Build the tree in caller-owned arrays (e.g. a shared mapping) of
+   * StorageSize(arr.size()) elements each, page aligned. They must outlive
+   * the tree.
+   */
+  BasicSegmentTree(const std::vector<int> &arr, ValueType *tree,
+                   Operation *operations)
+  {
+    size_ = arr.size();
+    int tree_size = NumNodes(size_);
+    std::fill_n(tree, tree_size, Node::Empty());
+    std::fill_n(operations, tree_size, Operation());
+    tree_ = CowArray<ValueType>(tree, tree_size);
+    operations_ = CowArray<Operation>(operations, tree_size);
+    if (!arr.empty())
+      BuildTree(arr, 0, arr.size(), 0);
+  }
+
+  /**
+   * @brief A tree which adopts arr as its leaves and builds nothing up
+   * front: each node's sum is computed the first time a query needs it,
+   * along with the rest of its subtree. Updates only record their
+   * operations on the unbuilt nodes they reach, and build the leaves they
+   * reach. Startup only marks every node unbuilt in a bitmap, with the
+   * tree's pages shared until first written (see CowArray::Sparse), and the
+   * build is paid only where queries go.
+   */
+  static BasicSegmentTree BuildLazily(std::vector<int> arr)
+  {
+    BasicSegmentTree tree;
+    tree.size_ = arr.size();
+    tree.tree_ =
+        CowArray<ValueType>::Sparse(NumNodes(arr.size()), Node::Empty());
+    tree.operations_ =
+        CowArray<Operation>::Sparse(NumNodes(arr.size()), Operation());
+    tree.unbuilt_.assign((NumNodes(arr.size()) + 63) / 64, ~uint64_t(0));
+    tree.leaves_ = std::make_shared<const std::vector<int>>(std::move(arr));
+    return tree;
+  }
+
+  // For a tree built lazily, the number of nodes built so far.
+  int NumBuilt()
+  {
+    int unbuilt = 0;
+    for (uint64_t word : unbuilt_)
+      unbuilt += std::popcount(word);
+    return unbuilt_.size() * 64 - unbuilt;
+  }
+
+  // Nodes in a tree over size elements.
+  static int NumNodes(int size) { return 4 * size + 1; }
+
+  // Elements to allocate for each array of a tree over size elements.
+  template <class T> static size_t StorageSize(int size)
+  {
+    return (NumNodes(size) + CowArray<T>::kPageMask) &
+           ~size_t(CowArray<T>::kPageMask);
   }
 
   void ApplyToRange(Cube domain, const Operation &op)
   {
-    ApplyOperationR(0, domain, {0, size()}, op);
+    if (domain.Volume() > 0)
+      ApplyOperationR(0, domain, {0, size()}, op);
+  }
+
+  /**
+   * @brief Apply a sequence of updates in one traversal. The result is the
+   * same as calling ApplyToRange on each update in order, but paths shared by
+   * several updates are only walked (and pushed) once.
+   */
+  void ApplyBatch(std::span<const Update> batch)
+  {
+    // Slot 0 holds the root's list, slot d + 1 the children's lists of the
+    // node visited at depth d.
+    batch_scratch_.resize(std::bit_width(unsigned(size())) + 2);
+    std::vector<Update> &root_batch = batch_scratch_[0][0];
+    root_batch.clear();
+    for (const Update &update : batch)
+      if (update.domain.Volume() > 0)
+        root_batch.push_back(update);
+    if (!root_batch.empty())
+      ApplyBatchR(0, {0, size()}, root_batch, 0);
+  }
+
+  /**
+   * @brief Execute a sequence of updates and queries in one traversal. Each
+   * query sees exactly the updates before it in ops, as if every op was
+   * executed in order by ApplyToRange or QueryRange.
+   *
+   * Ops are routed down the tree in order, as in ApplyBatch. A query which
+   * covers a node reads the node's sum at its place in the node's sequence,
+   * after the updates before it have reached the node.
+   */
+  void ExecuteOrdered(std::span<Op> ops)
+    requires std::same_as<Node, SumNode>
+  {
+    ordered_scratch_.resize(std::bit_width(unsigned(size())) + 2);
+    std::vector<OrderedItem> &root_items = ordered_scratch_[0][0];
+    root_items.clear();
+    for (int i = 0; i < int(ops.size()); i++)
+    {
+      ops[i].result = 0;
+      if (ops[i].domain.Volume() > 0)
+        root_items.push_back({ops[i].domain, i});
+    }
+    if (!root_items.empty())
+      ExecuteOrderedR(0, {0, size()}, ops, root_items, 0);
   }
 
   void AssignRange(Cube domain, int val) { ApplyToRange(domain, SetOp(val)); }
 
   void AddToRange(Cube domain, int inc) { ApplyToRange(domain, AddOp(inc)); }
 
-  int QueryRange(Cube domain) { return QueryRangeR(0, domain, {0, size()}); }
+  // The Value of domain, or Node::Empty() if domain is empty.
+  ValueType QueryRange(Cube domain)
+  {
+    if (domain.Volume() <= 0)
+      return Node::Empty();
+    if (domain.l == 0)
+      return QueryPrefix(domain.r);
+    if (domain.r == size())
+      return QuerySuffix(domain.l);
+    return QueryRangeR(0, domain, {0, size()});
+  }
+
+  /**
+   * @brief The Value of [0, r). A prefix only splits the nodes on one path:
+   * walks down that path, combining the Values of the left children it
+   * passes, and applies the pending operations on the way to them instead
+   * of pushing.
+   */
+  ValueType QueryPrefix(int r)
+  {
+    if (r <= 0)
+      return Node::Empty();
+    ValueType sum = Node::Empty();
+    int v = 0;
+    Cube domain = {0, size()};
+    // The pending operations of the ancestors of v, composed.
+    Operation pending;
+    while (domain.r > r)
+    {
+      Operation op = std::as_const(operations_)[v];
+      op.ComposeWith(pending);
+      pending = op;
+      auto [left_domain, right_domain] = domain.Subdivide();
+      if (r <= left_domain.r)
+      {
+        v = Left(v);
+        domain = left_domain;
+      }
+      else
+      {
+        sum = Node::Combine(sum, Node::Apply(pending,
+                                             Value(Left(v), left_domain),
+                                             left_domain));
+        v = Right(v);
+        domain = right_domain;
+      }
+    }
+    return Node::Combine(sum, Node::Apply(pending, Value(v, domain), domain));
+  }
+
+  // The Value of [l, size()), as QueryPrefix.
+  ValueType QuerySuffix(int l)
+  {
+    if (l >= size())
+      return Node::Empty();
+    ValueType sum = Node::Empty();
+    int v = 0;
+    Cube domain = {0, size()};
+    Operation pending;
+    while (domain.l < l)
+    {
+      Operation op = std::as_const(operations_)[v];
+      op.ComposeWith(pending);
+      pending = op;
+      auto [left_domain, right_domain] = domain.Subdivide();
+      if (l >= right_domain.l)
+      {
+        v = Right(v);
+        domain = right_domain;
+      }
+      else
+      {
+        sum = Node::Combine(sum, Node::Apply(pending,
+                                             Value(Right(v), right_domain),
+                                             right_domain));
+        v = Left(v);
+        domain = left_domain;
+      }
+    }
+    return Node::Combine(sum, Node::Apply(pending, Value(v, domain), domain));
+  }
+
+  /**
+   * @brief Like QueryRange({i, i + 1}), but reads the leaf and the pending
+   * additions on its path without pushing, unless an assignment is pending
+   * on the path.
+   */
+  int Get(int i)
+    requires std::same_as<Node, SumNode>
+  {
+    int pending = 0;
+    int leaf = FindLeaf(i, pending);
+    if (leaf < 0)
+      return QueryRange({i, i + 1});
+    return std::as_const(tree_)[leaf] + pending;
+  }
 
-  int Get(int i) { return QueryRange({i, i + 1}); }
+  /**
+   * @brief Like AssignRange({i, i + 1}, val), but unless an assignment is
+   * pending on the path of i, adds the difference to the leaf and its
+   * ancestors bottom up, one addition per level, instead of pushing.
+   */
+  void Set(int i, int val)
+    requires std::same_as<Node, SumNode>
+  {
+    int pending = 0;
+    int leaf = FindLeaf(i, pending);
+    if (leaf < 0)
+      AssignRange({i, i + 1}, val);
+    else
+      AddToPath(leaf, val - std::as_const(tree_)[leaf] - pending);
+  }
+
+  // Like AddToRange({i, i + 1}, inc), as Set is to AssignRange.
+  void Add(int i, int inc)
+    requires std::same_as<Node, SumNode>
+  {
+    int pending = 0;
+    int leaf = FindLeaf(i, pending);
+    if (leaf < 0)
+      AddToRange({i, i + 1}, inc);
+    else
+      AddToPath(leaf, inc);
+  }
+
+  /**
+   * @brief Call fn(i, value) for every nonzero value in domain, in order, in
+   * O(k log n) for k such values. Requires every value to be non-negative,
+   * so that a zero sum proves a subtree empty: with negative values, the
+   * elements of a subtree summing to zero are skipped. Asserted on every
+   * node visited.
+   */
+  template <class Fn>
+  void ForEachNonZero(Cube domain, Fn &&fn)
+    requires std::same_as<Node, SumNode>
+  {
+    if (domain.Volume() > 0)
+      ForEachNonZeroR(0, domain, {0, size()}, fn);
+  }
 
   int size() { return size_; }
 
-private:
+  /**
+   * @brief Return a clone which shares its storage with this tree, page by
+   * page, until either of them writes to a page. Costs O(n / 1024).
+   */
+  BasicSegmentTree Fork()
+  {
+    BasicSegmentTree child;
+    child.size_ = size_;
+    child.tree_ = tree_.Fork();
+    child.operations_ = operations_.Fork();
+    child.unbuilt_ = unbuilt_;
+    child.leaves_ = leaves_;
+    child.checkpoint_generation_ = checkpoint_generation_;
+    child.checkpoint_lineage_ = checkpoint_lineage_;
+    return child;
+  }
+
+protected:
   int size_;
 
-  std::vector<int> tree_;
-  std::vector<Operation> operations_;
+  // Reads which do not modify the tree go through std::as_const, so that
+  // they do not copy pages shared with a fork.
+  CowArray<ValueType> tree_;
+  CowArray<Operation> operations_;
+
+  // For trees built lazily: a bit per node, set until the node's value in
+  // tree_ is computed, and the leaves they are computed from. The value of
+  // an unbuilt node is its children's combined, with its operation applied.
+  // A node is built along with its whole subtree, so the ancestors of an
+  // unbuilt node are unbuilt. Empty for trees built eagerly.
+  std::vector<uint64_t> unbuilt_;
+  std::shared_ptr<const std::vector<int>> leaves_;
+
+  // Per-depth update lists for ApplyBatchR: batch_scratch_[d] holds the
+  // lists of the left and right node at depth d being visited.
+  std::vector<std::array<std::vector<Update>, 2>> batch_scratch_;
+
+  // The part of ops[index] within a node, for ExecuteOrderedR.
+  struct OrderedItem
+  {
+    Cube domain;
+    int index;
+  };
+
+  // Shorter runs of ops are executed one by one by ExecuteOrderedR.
+  static constexpr size_t kMinRoutedRun = 4;
+
+  // Per-depth lists for ExecuteOrderedR, like batch_scratch_.
+  std::vector<std::array<std::vector<OrderedItem>, 2>> ordered_scratch_;
+
+  // Generation and lineage of the last checkpoint written or restored.
+  uint64_t checkpoint_generation_ = 0;
+  uint64_t checkpoint_lineage_ = 0;
+  // Lineage of the checkpoints this tree writes, drawn on its first write:
+  // forks and restored trees get their own, so that their chains never mix
+  // with their origin's. 0 until then.
+  uint64_t lineage_ = 0;
+
+  // Reads and writes the storage directly; see checkpoint.h.
+  friend class SegmentTreeCheckpoint;
+
+  BasicSegmentTree() = default;
+
+  void Allocate(int size)
+  {
+    size_ = size;
+    int tree_size = NumNodes(size);
+    tree_ = CowArray<ValueType>(tree_size, Node::Empty());
+    operations_ = CowArray<Operation>(tree_size, Operation());
+  }
+
+  // Nodes are written once built with relaxed atomic stores, which compile
+  // to plain moves, so that readers of a tree in shared memory may load
+  // them concurrently (see shmsegtree.h). Values too wide to store without
+  // a lock are never shared, and are stored plainly.
+  template <class T> static void Store(T &node, const T &value)
+  {
+    if constexpr (std::atomic_ref<T>::is_always_lock_free)
+      std::atomic_ref<T>(node).store(value, std::memory_order_relaxed);
+    else
+      node = value;
+  }
 
   Operation AddOp(int add) { return {false, add}; }
   Operation SetOp(int nv) { return {true, nv}; }
@@ -100,44 +488,131 @@ private:
   int Left(int v) { return 2 * v + 1; }
   int Right(int v) { return 2 * v + 2; }
 
-  // Recompute based on childrens' values.
+  bool IsBuilt(int v) { return !(unbuilt_[v >> 6] >> (v & 63) & 1); }
+
+  // Compute the value of v, and of its unbuilt descendants, if needed.
+  // Requires a lazily built tree.
+  void Build(int v, Cube domain)
+  {
+    if (IsBuilt(v))
+      return;
+    if (domain.IsPoint())
+      tree_[v] = Node::Leaf((*leaves_)[domain.l]);
+    else
+    {
+      auto [left_domain, right_domain] = domain.Subdivide();
+      Build(Left(v), left_domain);
+      Build(Right(v), right_domain);
+      tree_[v] = Node::Apply(std::as_const(operations_)[v],
+                             Node::Combine(std::as_const(tree_)[Left(v)],
+                                           std::as_const(tree_)[Right(v)]),
+                             domain);
+    }
+    unbuilt_[v >> 6] &= ~(uint64_t(1) << (v & 63));
+  }
+
+  ValueType Value(int v, Cube domain)
+  {
+    if (!unbuilt_.empty())
+      Build(v, domain);
+    return std::as_const(tree_)[v];
+  }
+
+  // Recompute based on childrens' values. An unbuilt node is left to be
+  // computed from them when needed.
   void UpdateValueFromBelow(int v)
   {
-    tree_[v] = tree_[Left(v)] + tree_[Right(v)];
+    if (!unbuilt_.empty() && !IsBuilt(v))
+      return;
+    Store(tree_[v], Node::Combine(std::as_const(tree_)[Left(v)],
+                                  std::as_const(tree_)[Right(v)]));
   }
 
-  // Recompute based on pending operations.
-  void UpdateValueFromAbove(int v, Cube domain)
+  // Apply op to the (already up to date) value of v.
+  void UpdateValueFromAbove(int v, Cube domain, const Operation &op)
   {
-    tree_[v] = operations_[v].Evaluate(tree_[v], domain);
+    Store(tree_[v], Node::Apply(op, Value(v, domain), domain));
   }
 
-  // FIXME unclear functionality despite correctness.
+  /**
+   * @brief Apply op to node v. The value of v is updated immediately, and op
+   * is recorded as pending for the children of v (if there are any).
+   */
   void EvaluateAny(int v, Cube domain, const Operation &op)
   {
-    operations_[v].ComposeWith(op);
-    UpdateValueFromAbove(v, domain);
-    if (domain.IsPoint())
-      operations_[v].Reset();
+    // An unbuilt node's value will include op once computed.
+    if (unbuilt_.empty() || IsBuilt(v) || domain.IsPoint())
+      UpdateValueFromAbove(v, domain, op);
+    if (!domain.IsPoint())
+    {
+      Operation composed = std::as_const(operations_)[v];
+      composed.ComposeWith(op);
+      Store(operations_[v], composed);
+    }
   }
 
   /**
-   * @brief Evaluate the operation for this node, push it onto its
-   * children, and reset the operation to the identity.
+   * @brief Apply the pending operation of this node to its children, and
+   * reset the operation to the identity.
    */
   void Push(int v, Cube domain)
   {
+    if (std::as_const(operations_)[v].IsIdentity())
+      return;
     auto [left_domain, right_domain] = domain.Subdivide();
-    operations_[Left(v)].ComposeWith(operations_[v]);
-    operations_[Right(v)].ComposeWith(operations_[v]);
-    // Evaluate leaves immediately.
-    if (left_domain.IsPoint())
-      UpdateValueFromAbove(Left(v), left_domain);
-    if (right_domain.IsPoint())
-      UpdateValueFromAbove(Right(v), right_domain);
-    // Recompute current value and clear the current operation.
-    UpdateValueFromAbove(v, domain);
-    operations_[v].Reset();
+    EvaluateAny(Left(v), left_domain, operations_[v]);
+    EvaluateAny(Right(v), right_domain, operations_[v]);
+    Store(operations_[v], Operation());
+  }
+
+  /**
+   * @brief Return the leaf of element i, and add the additions pending for
+   * it on the way to pending. Pending additions commute with additions to
+   * the leaf and its ancestors, so those need no push. Returns -1 if an
+   * assignment is pending on the path. Builds the leaf if needed.
+   */
+  int FindLeaf(int i, int &pending)
+  {
+    int v = 0;
+    Cube domain = {0, size_};
+    while (true)
+    {
+      if (domain.IsPoint())
+      {
+        if (!unbuilt_.empty())
+          Build(v, domain);
+        return v;
+      }
+      const Operation &op = std::as_const(operations_)[v];
+      if (op.reset_pending)
+        return -1;
+      pending += op.to_add;
+      int m = domain.Center();
+      if (i < m)
+      {
+        v = Left(v);
+        domain.r = m;
+      }
+      else
+      {
+        v = Right(v);
+        domain.l = m;
+      }
+    }
+  }
+
+  // Add inc to v and every built ancestor of v.
+  void AddToPath(int v, int inc)
+  {
+    while (true)
+    {
+      if (!unbuilt_.empty() && !IsBuilt(v))
+        return; // and so are the ancestors left.
+      Store(tree_[v], std::as_const(tree_)[v] + inc);
+      if (v == 0)
+        return;
+      v = (v - 1) / 2;
+    }
   }
 
   void ApplyOperationR(int v, Cube query_domain, Cube node_domain,
@@ -165,36 +640,223 @@ private:
     }
   }
 
-  int QueryRangeR(int v, Cube query_domain, Cube node_domain)
+  ValueType QueryRangeR(int v, Cube query_domain, Cube node_domain)
   {
     // Assume node_domain contains query_domain
     auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
 
     if (query_domain == node_domain) // range covers this node.
-      return tree_[v];
+      return Value(v, node_domain);
     else
     {
       Push(v, node_domain); // Defer overwrites.
 
-      int sum = 0;
+      ValueType sum = Node::Empty();
       // Query left subset.
       if (!query_domain.IsDisjointFrom(left_node_domain))
-        sum +=
+        sum = Node::Combine(
+            sum,
             QueryRangeR(Left(v), left_node_domain.IntersectWith(query_domain),
-                        left_node_domain);
+                        left_node_domain));
       // Query right subset.
       if (!query_domain.IsDisjointFrom(right_node_domain))
-        sum +=
+        sum = Node::Combine(
+            sum,
             QueryRangeR(Right(v), right_node_domain.IntersectWith(query_domain),
-                        right_node_domain);
+                        right_node_domain));
       return sum;
     }
   }
 
+  void ApplyBatchR(int v, Cube node_domain, const std::vector<Update> &batch,
+                   int depth)
+  {
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    auto &[left_batch, right_batch] = batch_scratch_[depth + 1];
+
+    size_t i = 0;
+    while (i < batch.size())
+    {
+      // Updates which cover this node are tags on this node. Every update
+      // reaching a leaf covers it.
+      for (; i < batch.size() && batch[i].domain == node_domain; i++)
+        EvaluateAny(v, node_domain, batch[i].op);
+      if (i == batch.size())
+        return;
+
+      // Route the run of updates up to the next tag to the children in one
+      // pass, preserving their order.
+      Push(v, node_domain);
+      left_batch.clear();
+      right_batch.clear();
+      for (; i < batch.size() && !(batch[i].domain == node_domain); i++)
+      {
+        const Update &update = batch[i];
+        if (update.domain.l < left_node_domain.r)
+          left_batch.push_back(
+              {left_node_domain.IntersectWith(update.domain), update.op});
+        if (update.domain.r > right_node_domain.l)
+          right_batch.push_back(
+              {right_node_domain.IntersectWith(update.domain), update.op});
+      }
+
+      // The left subtree only uses deeper scratch lists, so right_batch
+      // survives it.
+      if (!left_batch.empty())
+        ApplyBatchR(Left(v), left_node_domain, left_batch, depth + 1);
+      if (!right_batch.empty())
+        ApplyBatchR(Right(v), right_node_domain, right_batch, depth + 1);
+      UpdateValueFromBelow(v);
+    }
+  }
+
+  void ExecuteOrderedR(int v, Cube node_domain, std::span<Op> ops,
+                       const std::vector<OrderedItem> &items, int depth)
+  {
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    auto &[left_items, right_items] = ordered_scratch_[depth + 1];
+
+    size_t i = 0;
+    while (i < items.size())
+    {
+      // Ops which cover this node are tags on it, or read its sum.
+      for (; i < items.size() && items[i].domain == node_domain; i++)
+      {
+        Op &op = ops[items[i].index];
+        if (op.is_query)
+          op.result += Value(v, node_domain);
+        else
+          EvaluateAny(v, node_domain, op.op);
+      }
+      if (i == items.size())
+        return;
+
+      // A short run is cheaper to execute directly than to route.
+      size_t end = i;
+      while (end < items.size() && end - i < kMinRoutedRun &&
+             !(items[end].domain == node_domain))
+        end++;
+      if (end - i < kMinRoutedRun)
+      {
+        for (; i < end; i++)
+        {
+          Op &op = ops[items[i].index];
+          if (op.is_query)
+            op.result += QueryRangeR(v, items[i].domain, node_domain);
+          else
+            ApplyOperationR(v, items[i].domain, node_domain, op.op);
+        }
+        continue;
+      }
+
+      // Route the run of ops up to the next covering one to the children,
+      // preserving their order.
+      Push(v, node_domain);
+      left_items.clear();
+      right_items.clear();
+      bool updates = false;
+      for (; i < items.size() && !(items[i].domain == node_domain); i++)
+      {
+        const OrderedItem &item = items[i];
+        updates |= !ops[item.index].is_query;
+        if (item.domain.l < left_node_domain.r)
+          left_items.push_back(
+              {left_node_domain.IntersectWith(item.domain), item.index});
+        if (item.domain.r > right_node_domain.l)
+          right_items.push_back(
+              {right_node_domain.IntersectWith(item.domain), item.index});
+      }
+
+      if (!left_items.empty())
+        ExecuteOrderedR(Left(v), left_node_domain, ops, left_items, depth + 1);
+      if (!right_items.empty())
+        ExecuteOrderedR(Right(v), right_node_domain, ops, right_items,
+                        depth + 1);
+      if (updates)
+        UpdateValueFromBelow(v);
+    }
+  }
+
+  template <class Fn>
+  void ForEachNonZeroR(int v, Cube query_domain, Cube node_domain, Fn &fn)
+  {
+    int value = Value(v, node_domain);
+    assert(value >= 0);
+    if (value == 0) // nothing below.
+      return;
+    if (node_domain.IsPoint())
+    {
+      fn(node_domain.l, value);
+      return;
+    }
+
+    Push(v, node_domain);
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      ForEachNonZeroR(Left(v), left_node_domain.IntersectWith(query_domain),
+                      left_node_domain, fn);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      ForEachNonZeroR(Right(v), right_node_domain.IntersectWith(query_domain),
+                      right_node_domain, fn);
+  }
+
+  /**
+   * @brief Build a tree over a power-of-two number of elements bottom up. The
+   * tree is then a complete heap, with the nodes at depth d numbered
+   * 2^d - 1, ..., 2^(d + 1) - 2 from left to right, so every level is the
+   * pairwise combination of the level below: one streaming pass per level,
+   * in a loop the compiler can vectorize.
+   */
+  void BuildLevels(const std::vector<int> &arr)
+  {
+    constexpr int kPageSize = CowArray<ValueType>::kPageSize;
+    constexpr int kPageMask = CowArray<ValueType>::kPageMask;
+    constexpr int kPageShift = CowArray<ValueType>::kPageShift;
+    int size = arr.size();
+    for (int i = 0; i < size;)
+    {
+      int v = size - 1 + i;
+      int len = std::min(size - i, kPageSize - (v & kPageMask));
+      std::transform(arr.data() + i, arr.data() + i + len,
+                     tree_.MutablePage(v >> kPageShift) + (v & kPageMask),
+                     Node::Leaf);
+      i += len;
+    }
+    for (int width = size / 2; width >= 1; width /= 2)
+      CombinePairs(width - 1, 2 * width - 1, width);
+  }
+
+  // Set the count nodes from first to the combinations of consecutive pairs
+  // of the nodes from children on, one run within a page of each at a time.
+  void CombinePairs(int first, int children, int count)
+  {
+    constexpr int kPageSize = CowArray<ValueType>::kPageSize;
+    constexpr int kPageMask = CowArray<ValueType>::kPageMask;
+    constexpr int kPageShift = CowArray<ValueType>::kPageShift;
+    for (int i = 0; i < count;)
+    {
+      int v = first + i, c = children + 2 * i;
+      int len = std::min({count - i, kPageSize - (v & kPageMask),
+                          (kPageSize - (c & kPageMask)) / 2});
+      if (len == 0) // the pair straddles two pages.
+      {
+        tree_[v] = Node::Combine(std::as_const(tree_)[c],
+                                 std::as_const(tree_)[c + 1]);
+        i++;
+        continue;
+      }
+      ValueType *out = tree_.MutablePage(v >> kPageShift) + (v & kPageMask);
+      const ValueType *in = tree_.page(c >> kPageShift) + (c & kPageMask);
+      for (int j = 0; j < len; j++)
+        out[j] = Node::Combine(in[2 * j], in[2 * j + 1]);
+      i += len;
+    }
+  }
+
   void BuildTree(const std::vector<int> &arr, int l, int r, int v)
   {
     if (r - l == 1)
-      tree_[v] = arr[l];
+      tree_[v] = Node::Leaf(arr[l]);
     else
     {
       BuildTree(arr, l, (l + r) / 2, Left(v));
@@ -203,3 +865,5 @@ private:
     }
   }
 };
+
+using SegmentTree = BasicSegmentTree<SumNode>;
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief An add-only front end which gives every writer thread its own delta
+ * structure, so concurrent AddToRange calls share no cache lines.
+ *
+ * Each thread's deltas live in a pair of range-add/range-sum Fenwick trees.
+ * QueryRange sums the base SegmentTree and every thread's deltas, and
+ * Consolidate folds the deltas into the base so that they can be reused.
+ *
+ * A query sees each concurrent update either entirely or not at all, but
+ * updates from different threads are not ordered with respect to it.
+ */
+class ShardedSegmentTree
+{
+public:
+  ShardedSegmentTree(const std::vector<int> &arr)
+      : id_(next_id_.fetch_add(1, std::memory_order_relaxed)), base_(arr)
+  {
+  }
+
+  ShardedSegmentTree(const ShardedSegmentTree &) = delete;
+  ShardedSegmentTree &operator=(const ShardedSegmentTree &) = delete;
+
+  // Lock-free after the calling thread's first update.
+  void AddToRange(Cube domain, int inc)
+  {
+    if (domain.Volume() > 0)
+      LocalShard().Add(domain, inc);
+  }
+
+  int QueryRange(Cube domain)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    long long sum = base_.QueryRange(domain);
+    for (const std::unique_ptr<Shard> &shard : shards_)
+      sum += shard->QueryRange(domain);
+    return sum;
+  }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  /**
+   * @brief Move every thread's accumulated deltas into the base tree. Writers
+   * are not blocked, their updates land in the other half of their shard.
+   */
+  void Consolidate()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<Shard> &shard : shards_)
+    {
+      shard->Retire();
+      shard->Drain(base_, batch_);
+    }
+  }
+
+  int size() { return base_.size(); }
+
+private:
+  // Range-add/range-sum over a difference array D: adding x to [l, r) adds x
+  // to D[l] and -x to D[r], and the prefix sum up to r is
+  // r * sum(D[j]) - sum(j * D[j]) over j < r.
+  //
+  // Cells are only ever written by the owning thread, so relaxed atomics are
+  // enough for them to be read concurrently.
+  struct Fenwick
+  {
+    std::vector<std::atomic<long long>> d;
+    std::vector<std::atomic<long long>> jd;
+
+    Fenwick(int size) : d(size + 1), jd(size + 1) {}
+
+    int size() const { return d.size() - 1; }
+
+    void AddPoint(int j, long long x)
+    {
+      long long jx = j * x;
+      for (int i = j + 1; i <= size(); i += i & -i)
+      {
+        d[i].store(d[i].load(std::memory_order_relaxed) + x,
+                   std::memory_order_relaxed);
+        jd[i].store(jd[i].load(std::memory_order_relaxed) + jx,
+                    std::memory_order_relaxed);
+      }
+    }
+
+    void AddToRange(Cube domain, int inc)
+    {
+      AddPoint(domain.l, inc);
+      if (domain.r < size())
+        AddPoint(domain.r, -inc);
+    }
+
+    long long Prefix(int r) const
+    {
+      long long sum_d = 0, sum_jd = 0;
+      for (int i = r; i > 0; i -= i & -i)
+      {
+        sum_d += d[i].load(std::memory_order_relaxed);
+        sum_jd += jd[i].load(std::memory_order_relaxed);
+      }
+      return r * sum_d - sum_jd;
+    }
+
+    long long QueryRange(Cube domain) const
+    {
+      return Prefix(domain.r) - Prefix(domain.l);
+    }
+
+    /**
+     * @brief Append the deltas as range updates to batch (one per run of
+     * equal deltas), and reset every cell to zero.
+     */
+    void Drain(std::vector<Update> &batch)
+    {
+      // Invert the Fenwick layout to recover D, in O(n).
+      std::vector<long long> diff(size() + 1);
+      for (int i = 1; i <= size(); i++)
+        diff[i] = d[i].exchange(0, std::memory_order_relaxed);
+      for (int i = size(); i > 0; i--)
+        if (int j = i + (i & -i); j <= size())
+          diff[j] -= diff[i];
+      for (int i = 1; i <= size(); i++)
+        jd[i].store(0, std::memory_order_relaxed);
+
+      // D[j] != 0 exactly where a run of equal deltas starts.
+      long long delta = 0;
+      int run_start = 0;
+      for (int j = 0; j < size(); j++)
+      {
+        if (diff[j + 1] == 0)
+          continue;
+        if (delta != 0)
+          batch.push_back({{run_start, j}, {false, int(delta)}});
+        delta += diff[j + 1];
+        run_start = j;
+      }
+      if (delta != 0)
+        batch.push_back({{run_start, size()}, {false, int(delta)}});
+    }
+  };
+
+  // One writer thread's deltas. Updates go to halves[active]; Consolidate
+  // flips active and drains the other half.
+  struct alignas(64) Shard
+  {
+    std::atomic<int> active = 0;
+    // Odd while the writer is updating; see Add and QueryRange.
+    std::atomic<uint64_t> seq = 0;
+    Fenwick halves[2];
+
+    Shard(int size) : halves{Fenwick(size), Fenwick(size)} {}
+
+    void Add(Cube domain, int inc)
+    {
+      uint64_t s = seq.load(std::memory_order_relaxed);
+      seq.store(s + 1, std::memory_order_relaxed);
+      // Orders the odd seq before the cells, for readers, and before the
+      // load of active, for Retire: either it sees seq odd, or we see the
+      // flipped active half.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      halves[active.load(std::memory_order_relaxed)].AddToRange(domain, inc);
+      seq.store(s + 2, std::memory_order_release);
+    }
+
+    long long QueryRange(Cube domain) const
+    {
+      while (true)
+      {
+        uint64_t s = seq.load(std::memory_order_acquire);
+        if (s & 1)
+          continue;
+        long long sum =
+            halves[0].QueryRange(domain) + halves[1].QueryRange(domain);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) == s)
+          return sum;
+      }
+    }
+
+    // Redirect the writer to the other half, and wait until it has left the
+    // current one.
+    void Retire()
+    {
+      active.store(1 - active.load(std::memory_order_relaxed),
+                   std::memory_order_seq_cst);
+      uint64_t s = seq.load(std::memory_order_seq_cst);
+      if (s & 1)
+        while (seq.load(std::memory_order_acquire) == s)
+          ;
+    }
+
+    void Drain(SegmentTree &base, std::vector<Update> &batch)
+    {
+      batch.clear();
+      halves[1 - active.load(std::memory_order_relaxed)].Drain(batch);
+      base.ApplyBatch(batch);
+    }
+  };
+
+  // Entries of a thread's shard cache; see LocalShard.
+  static constexpr int kCacheSize = 4;
+
+  // Tree ids, and thread ids which (unlike std::thread::id) are never
+  // reused: a shard has a single writer for good.
+  inline static std::atomic<uint64_t> next_id_ = 1;
+  inline static std::atomic<uint64_t> next_thread_ = 0;
+
+  // Identifies this tree in the thread-local shard caches. Never reused, so
+  // entries left behind by destroyed trees never match.
+  const uint64_t id_;
+
+  // Guards base_, shards_ and owners_ (but not the shards' contents).
+  std::mutex mutex_;
+  SegmentTree base_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::unordered_map<uint64_t, Shard *> owners_;
+  std::vector<Update> batch_;
+
+  // The calling thread's shard. A small thread-local cache of the trees it
+  // used last avoids the lock; on a miss, the shard is looked up (or
+  // created) under it, and replaces the oldest entry.
+  Shard &LocalShard()
+  {
+    struct Entry
+    {
+      uint64_t id = 0;
+      Shard *shard = nullptr;
+    };
+    thread_local Entry cache[kCacheSize];
+    thread_local int next = 0;
+    thread_local const uint64_t thread =
+        next_thread_.fetch_add(1, std::memory_order_relaxed);
+    for (const Entry &entry : cache)
+      if (entry.id == id_)
+        return *entry.shard;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Shard *&shard = owners_[thread];
+    if (shard == nullptr)
+    {
+      shards_.push_back(std::make_unique<Shard>(base_.size()));
+      shard = shards_.back().get();
+    }
+    cache[next] = {id_, shard};
+    next = (next + 1) % kCacheSize;
+    return *shard;
+  }
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "segtree.h"
+
+/**
+ * @brief Start of a POSIX shared memory segment holding a SegmentTree. The
+ * arrays are addressed by offsets from the start of the segment, so every
+ * process may map it at a different address.
+ */
+struct SharedTreeHeader
+{
+  static constexpr uint32_t kMagic = 0x4853534a; // "JSSH"
+  // Bumped whenever the header or the tree layout changes.
+  static constexpr uint32_t kVersion = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  int32_t size;
+  int32_t num_nodes;
+  uint64_t tree_offset;
+  uint64_t operations_offset;
+  uint64_t bytes;
+  // Odd while the writer is modifying the tree (a seqlock).
+  std::atomic<uint64_t> seq;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the seqlock must be address free to work across processes");
+static_assert(std::atomic_ref<int>::is_always_lock_free &&
+                  std::atomic_ref<Operation>::is_always_lock_free,
+              "nodes must be loaded and stored without locks");
+
+/**
+ * @brief The single writer of a shared tree. Creates the segment, builds the
+ * tree in it, and brackets every access with the seqlock (queries too, since
+ * they push tags down). SegmentTree stores nodes with relaxed atomic stores,
+ * so they do not race with the readers' loads.
+ */
+class SharedSegmentTree
+{
+public:
+  // Create the segment and build arr in it. An existing segment of the same
+  // name is unlinked; its readers keep reading it.
+  SharedSegmentTree(const std::string &name, const std::vector<int> &arr)
+      : header_(CreateSegment(name, arr.size())),
+        tree_(arr, Array<int>(header_->tree_offset),
+              Array<Operation>(header_->operations_offset))
+  {
+    header_->seq.store(2, std::memory_order_release);
+  }
+
+  SharedSegmentTree(const SharedSegmentTree &) = delete;
+  SharedSegmentTree &operator=(const SharedSegmentTree &) = delete;
+
+  // The segment stays until Unlink, so readers may outlive the writer.
+  ~SharedSegmentTree() { ::munmap(header_, header_->bytes); }
+
+  static void Unlink(const std::string &name) { ::shm_unlink(name.c_str()); }
+
+  void ApplyToRange(Cube domain, const Operation &op)
+  {
+    BeginWrite();
+    tree_.ApplyToRange(domain, op);
+    EndWrite();
+  }
+
+  void AssignRange(Cube domain, int val) { ApplyToRange(domain, {true, val}); }
+
+  void AddToRange(Cube domain, int inc) { ApplyToRange(domain, {false, inc}); }
+
+  int QueryRange(Cube domain)
+  {
+    BeginWrite();
+    int sum = tree_.QueryRange(domain);
+    EndWrite();
+    return sum;
+  }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  int size() { return tree_.size(); }
+
+private:
+  SharedTreeHeader *header_;
+  SegmentTree tree_;
+
+  template <class T> T *Array(uint64_t offset)
+  {
+    return reinterpret_cast<T *>(reinterpret_cast<char *>(header_) + offset);
+  }
+
+  void BeginWrite()
+  {
+    header_->seq.store(header_->seq.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void EndWrite()
+  {
+    header_->seq.store(header_->seq.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+  }
+
+  static SharedTreeHeader *CreateSegment(const std::string &name, int size)
+  {
+    constexpr uint64_t kPage = 4096;
+    uint64_t tree_bytes = SegmentTree::StorageSize<int>(size) * sizeof(int);
+    uint64_t operations_bytes =
+        SegmentTree::StorageSize<Operation>(size) * sizeof(Operation);
+    uint64_t tree_offset = kPage;
+    uint64_t operations_offset = tree_offset + tree_bytes;
+    uint64_t bytes = operations_offset + operations_bytes;
+
+    // A new segment, rather than the old one truncated: readers of the old
+    // one keep their mapping, instead of faulting on its truncated pages.
+    if (::shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+      throw std::system_error(errno, std::generic_category(), "shm_unlink");
+    int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "shm_open");
+    if (::ftruncate(fd, bytes) != 0)
+    {
+      int error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), "ftruncate");
+    }
+    void *addr =
+        ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (addr == MAP_FAILED)
+      throw std::system_error(error, std::generic_category(), "mmap");
+
+    // Readers check magic last, so it is written last.
+    SharedTreeHeader *header = static_cast<SharedTreeHeader *>(addr);
+    header->version = SharedTreeHeader::kVersion;
+    header->size = size;
+    header->num_nodes = SegmentTree::NumNodes(size);
+    header->tree_offset = tree_offset;
+    header->operations_offset = operations_offset;
+    header->bytes = bytes;
+    // The tree is built before any reader can see an even sequence number.
+    header->seq.store(1, std::memory_order_relaxed);
+    std::atomic_ref<uint32_t>(header->magic)
+        .store(SharedTreeHeader::kMagic, std::memory_order_release);
+    return header;
+  }
+};
+
+/**
+ * @brief A read-only view of a shared tree, for any number of processes.
+ *
+ * Readers never write to the segment: queries carry the pending tags of the
+ * ancestors down instead of pushing them, and retry if the writer modified
+ * the tree meanwhile. Each query is linearizable with respect to the
+ * writer's operations.
+ */
+class SharedSegmentTreeReader
+{
+public:
+  SharedSegmentTreeReader(const std::string &name)
+  {
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "shm_open");
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+      int error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), "fstat");
+    }
+    bytes_ = st.st_size;
+    void *addr = ::mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (addr == MAP_FAILED)
+      throw std::system_error(error, std::generic_category(), "mmap");
+    header_ = static_cast<const SharedTreeHeader *>(addr);
+
+    if (bytes_ < sizeof(SharedTreeHeader) ||
+        Load(header_->magic) != SharedTreeHeader::kMagic ||
+        header_->version != SharedTreeHeader::kVersion ||
+        header_->bytes != bytes_)
+    {
+      ::munmap(addr, bytes_);
+      throw std::runtime_error("shared tree: bad or incompatible segment");
+    }
+    const char *base = static_cast<const char *>(addr);
+    tree_ = reinterpret_cast<const int *>(base + header_->tree_offset);
+    operations_ =
+        reinterpret_cast<const Operation *>(base + header_->operations_offset);
+  }
+
+  SharedSegmentTreeReader(const SharedSegmentTreeReader &) = delete;
+  SharedSegmentTreeReader &
+  operator=(const SharedSegmentTreeReader &) = delete;
+
+  ~SharedSegmentTreeReader()
+  {
+    ::munmap(const_cast<SharedTreeHeader *>(header_), bytes_);
+  }
+
+  int QueryRange(Cube domain) const
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    while (true)
+    {
+      uint64_t seq = header_->seq.load(std::memory_order_acquire);
+      if (seq & 1)
+        continue;
+      int sum = QueryRangeR(0, domain, {0, size()}, Operation());
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header_->seq.load(std::memory_order_relaxed) == seq)
+        return sum;
+    }
+  }
+
+  int Get(int i) const { return QueryRange({i, i + 1}); }
+
+  int size() const { return header_->size; }
+
+private:
+  const SharedTreeHeader *header_;
+  size_t bytes_;
+  const int *tree_;
+  const Operation *operations_;
+
+  // The writer may be modifying x concurrently; the seqlock discards the
+  // result if so.
+  template <class T> static T Load(const T &x)
+  {
+    return std::atomic_ref<T>(const_cast<T &>(x)).load(
+        std::memory_order_relaxed);
+  }
+
+  // Same layout as SegmentTree.
+  static int Left(int v) { return 2 * v + 1; }
+  static int Right(int v) { return 2 * v + 2; }
+
+  // above is the composition of the pending tags of v's ancestors, which have
+  // not been pushed to v yet.
+  int QueryRangeR(int v, Cube query_domain, Cube node_domain,
+                  const Operation &above) const
+  {
+    if (query_domain == node_domain) // range covers this node.
+      return above.Evaluate(Load(tree_[v]), node_domain);
+
+    Operation pending = Load(operations_[v]);
+    pending.ComposeWith(above);
+
+    auto [left_node_domain, right_node_domain] = node_domain.Subdivide();
+    int sum = 0;
+    if (!query_domain.IsDisjointFrom(left_node_domain))
+      sum += QueryRangeR(Left(v), left_node_domain.IntersectWith(query_domain),
+                         left_node_domain, pending);
+    if (!query_domain.IsDisjointFrom(right_node_domain))
+      sum +=
+          QueryRangeR(Right(v), right_node_domain.IntersectWith(query_domain),
+                      right_node_domain, pending);
+    return sum;
+  }
+};
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief A sequence with the API of SegmentTree which also grows and shrinks
+ * anywhere: an implicit treap, where an element's index is the number of
+ * elements before it. Insert, Erase, Split and Concat all take O(log n)
+ * expected time.
+ *
+ * Nodes live in a pool shared by the trees split from each other, addressed
+ * by index, and erased nodes are reused. As in SegmentTree, a node's value
+ * and sum include its own pending operation, which is pending only for its
+ * children.
+ */
+class ImplicitTreap
+{
+public:
+  ImplicitTreap() : pool_(std::make_shared<Pool>()) {}
+
+  ImplicitTreap(const std::vector<int> &arr) : ImplicitTreap()
+  {
+    root_ = Build(arr);
+  }
+
+  void ApplyToRange(Cube domain, const Operation &op)
+  {
+    if (domain.Volume() <= 0)
+      return;
+    auto [left, rest] = SplitR(root_, domain.l);
+    auto [middle, right] = SplitR(rest, domain.Volume());
+    EvaluateAny(middle, op);
+    root_ = Merge(Merge(left, middle), right);
+  }
+
+  void AssignRange(Cube domain, int val) { ApplyToRange(domain, {true, val}); }
+
+  void AddToRange(Cube domain, int inc) { ApplyToRange(domain, {false, inc}); }
+
+  int QueryRange(Cube domain)
+  {
+    if (domain.Volume() <= 0)
+      return 0;
+    return QueryRangeR(root_, domain);
+  }
+
+  int Get(int i) { return QueryRange({i, i + 1}); }
+
+  // Insert value before index pos, 0 <= pos <= size().
+  void Insert(int pos, int value)
+  {
+    auto [left, right] = SplitR(root_, pos);
+    root_ = Merge(Merge(left, NewNode(value)), right);
+  }
+
+  // Remove the elements in domain; the following ones move down.
+  void Erase(Cube domain)
+  {
+    if (domain.Volume() <= 0)
+      return;
+    auto [left, rest] = SplitR(root_, domain.l);
+    auto [middle, right] = SplitR(rest, domain.Volume());
+    FreeR(middle);
+    root_ = Merge(left, right);
+  }
+
+  // Keep the elements before pos and return the others as a new tree.
+  ImplicitTreap Split(int pos)
+  {
+    auto [left, right] = SplitR(root_, pos);
+    root_ = left;
+    return ImplicitTreap(pool_, right);
+  }
+
+  /**
+   * @brief Append the elements of other, which is left empty.
+   * O(log n) if other shares this tree's pool (it was split from it, or the
+   * other way around), and linear in other's size otherwise.
+   */
+  void Concat(ImplicitTreap &other)
+  {
+    int right = other.root_;
+    other.root_ = kNil;
+    if (other.pool_ != pool_)
+    {
+      std::vector<int> values;
+      values.reserve(other.Size(right));
+      other.CollectR(right, values);
+      other.FreeR(right);
+      right = Build(values);
+    }
+    root_ = Merge(root_, right);
+  }
+
+  int size() { return Size(root_); }
+
+  ImplicitTreap(const ImplicitTreap &) = delete;
+  ImplicitTreap &operator=(const ImplicitTreap &) = delete;
+
+  ImplicitTreap(ImplicitTreap &&other)
+      : pool_(other.pool_), root_(std::exchange(other.root_, kNil))
+  {
+  }
+
+  ImplicitTreap &operator=(ImplicitTreap &&other)
+  {
+    if (this != &other)
+    {
+      FreeR(root_);
+      pool_ = other.pool_;
+      root_ = std::exchange(other.root_, kNil);
+    }
+    return *this;
+  }
+
+  ~ImplicitTreap()
+  {
+    if (pool_)
+      FreeR(root_);
+  }
+
+private:
+  static constexpr int kNil = -1;
+
+  struct Node
+  {
+    int left;
+    int right;
+    uint32_t priority;
+    int size;
+    int value;
+    int sum;
+    Operation operation;
+  };
+
+  struct Pool
+  {
+    std::vector<Node> nodes;
+    std::vector<int> free;
+    uint64_t seed = 0x9e3779b97f4a7c15;
+
+    // splitmix64.
+    uint32_t NextPriority()
+    {
+      uint64_t z = seed += 0x9e3779b97f4a7c15;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      return uint32_t(z ^ (z >> 31));
+    }
+  };
+
+  std::shared_ptr<Pool> pool_;
+  int root_ = kNil;
+
+  ImplicitTreap(std::shared_ptr<Pool> pool, int root)
+      : pool_(std::move(pool)), root_(root)
+  {
+  }
+
+  Node &At(int v) { return pool_->nodes[v]; }
+
+  int Size(int v) { return v == kNil ? 0 : At(v).size; }
+
+  int Sum(int v) { return v == kNil ? 0 : At(v).sum; }
+
+  int NewNode(int value)
+  {
+    Node node = {kNil, kNil, pool_->NextPriority(), 1, value, value, {}};
+    if (!pool_->free.empty())
+    {
+      int v = pool_->free.back();
+      pool_->free.pop_back();
+      At(v) = node;
+      return v;
+    }
+    pool_->nodes.push_back(node);
+    return pool_->nodes.size() - 1;
+  }
+
+  void FreeR(int v)
+  {
+    if (v == kNil)
+      return;
+    FreeR(At(v).left);
+    FreeR(At(v).right);
+    pool_->free.push_back(v);
+  }
+
+  void CollectR(int v, std::vector<int> &values)
+  {
+    if (v == kNil)
+      return;
+    Push(v);
+    CollectR(At(v).left, values);
+    values.push_back(At(v).value);
+    CollectR(At(v).right, values);
+  }
+
+  void UpdateValueFromBelow(int v)
+  {
+    Node &node = At(v);
+    node.size = Size(node.left) + 1 + Size(node.right);
+    node.sum = Sum(node.left) + node.value + Sum(node.right);
+  }
+
+  void EvaluateAny(int v, const Operation &op)
+  {
+    if (v == kNil)
+      return;
+    Node &node = At(v);
+    node.value = op.Evaluate(node.value, {0, 1});
+    node.sum = op.Evaluate(node.sum, {0, node.size});
+    node.operation.ComposeWith(op);
+  }
+
+  void Push(int v)
+  {
+    Node &node = At(v);
+    if (node.operation.IsIdentity())
+      return;
+    EvaluateAny(node.left, node.operation);
+    EvaluateAny(node.right, node.operation);
+    At(v).operation.Reset();
+  }
+
+  // The first pos elements of v, and the others.
+  std::pair<int, int> SplitR(int v, int pos)
+  {
+    if (v == kNil)
+      return {kNil, kNil};
+    Push(v);
+    int left_size = Size(At(v).left);
+    if (pos <= left_size)
+    {
+      auto [left, right] = SplitR(At(v).left, pos);
+      At(v).left = right;
+      UpdateValueFromBelow(v);
+      return {left, v};
+    }
+    auto [left, right] = SplitR(At(v).right, pos - left_size - 1);
+    At(v).right = left;
+    UpdateValueFromBelow(v);
+    return {v, right};
+  }
+
+  int Merge(int left, int right)
+  {
+    if (left == kNil)
+      return right;
+    if (right == kNil)
+      return left;
+    if (At(left).priority > At(right).priority)
+    {
+      Push(left);
+      int merged = Merge(At(left).right, right);
+      At(left).right = merged;
+      UpdateValueFromBelow(left);
+      return left;
+    }
+    Push(right);
+    int merged = Merge(left, At(right).left);
+    At(right).left = merged;
+    UpdateValueFromBelow(right);
+    return right;
+  }
+
+  // query_domain is relative to the first element of v.
+  int QueryRangeR(int v, Cube query_domain)
+  {
+    Node &node = At(v);
+    if (query_domain == Cube{0, node.size}) // range covers this node.
+      return node.sum;
+
+    Push(v);
+    int left_size = Size(At(v).left);
+    Cube left_domain = {0, left_size};
+    Cube right_domain = {left_size + 1, At(v).size};
+    int sum = 0;
+    if (!query_domain.IsDisjointFrom(left_domain))
+      sum += QueryRangeR(At(v).left, left_domain & query_domain);
+    if (!query_domain.IsDisjointFrom({left_size, left_size + 1}))
+      sum += At(v).value;
+    if (!query_domain.IsDisjointFrom(right_domain))
+    {
+      Cube domain = right_domain & query_domain;
+      sum += QueryRangeR(At(v).right,
+                         {domain.l - left_size - 1, domain.r - left_size - 1});
+    }
+    return sum;
+  }
+
+  // A treap of arr in linear time: the Cartesian tree of random priorities.
+  int Build(const std::vector<int> &arr)
+  {
+    std::vector<int> spine;
+    for (int value : arr)
+    {
+      int v = NewNode(value), last = kNil;
+      while (!spine.empty() && At(spine.back()).priority < At(v).priority)
+      {
+        last = spine.back();
+        spine.pop_back();
+        UpdateValueFromBelow(last);
+      }
+      At(v).left = last;
+      if (!spine.empty())
+        At(spine.back()).right = v;
+      spine.push_back(v);
+    }
+    while (spine.size() > 1)
+    {
+      UpdateValueFromBelow(spine.back());
+      spine.pop_back();
+    }
+    if (spine.empty())
+      return kNil;
+    UpdateValueFromBelow(spine[0]);
+    return spine[0];
+  }
+};
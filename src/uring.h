@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief A minimal io_uring, without liburing: vectored reads queued by one
+ * thread, submitted in batches, and their completions.
+ */
+class IoUring
+{
+public:
+  /**
+   * @brief A ring of at least entries submission slots.
+   * @throws std::system_error if io_uring is unavailable, e.g. on an old
+   * kernel or under a seccomp filter.
+   */
+  IoUring(unsigned entries)
+  {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0)
+      throw std::system_error(errno, std::generic_category(),
+                              "io_uring_setup");
+
+    sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_bytes_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    single_mmap_ = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap_)
+      sq_bytes_ = cq_bytes_ = std::max(sq_bytes_, cq_bytes_);
+    sqes_bytes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ = Map(sq_bytes_, IORING_OFF_SQ_RING);
+    cq_ = single_mmap_ ? sq_ : Map(cq_bytes_, IORING_OFF_CQ_RING);
+    sqes_ = static_cast<struct io_uring_sqe *>(
+        Map(sqes_bytes_, IORING_OFF_SQES));
+
+    char *sq = static_cast<char *>(sq_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+
+    char *cq = static_cast<char *>(cq_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  }
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  ~IoUring() { Close(); }
+
+  /**
+   * @brief Queue a readv of fd at offset. iov must stay valid until the
+   * read completes.
+   * @return false if the submission queue is full.
+   */
+  bool PrepareReadv(int fd, const struct iovec *iov, unsigned iovcnt,
+                    off_t offset, uint64_t user_data)
+  {
+    unsigned tail = std::atomic_ref<unsigned>(*sq_tail_).load(
+        std::memory_order_relaxed);
+    unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(
+        std::memory_order_acquire);
+    if (tail - head == sq_entries_)
+      return false;
+
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe &sqe = sqes_[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(iov);
+    sqe.len = iovcnt;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+    sq_array_[index] = index;
+    std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1,
+                                               std::memory_order_release);
+    queued_++;
+    return true;
+  }
+
+  // Submit the queued reads, and wait for at least wait_nr completions.
+  void Submit(unsigned wait_nr)
+  {
+    while (true)
+    {
+      int n = ::syscall(__NR_io_uring_enter, ring_fd_, queued_, wait_nr,
+                        wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(),
+                                "io_uring_enter");
+      }
+      queued_ -= n;
+      in_flight_ += n;
+      return;
+    }
+  }
+
+  /**
+   * @brief Take a completion, if there is one.
+   * @param res the number of bytes read, or -errno.
+   */
+  bool Reap(uint64_t &user_data, int &res)
+  {
+    unsigned head = std::atomic_ref<unsigned>(*cq_head_).load(
+        std::memory_order_relaxed);
+    unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(
+        std::memory_order_acquire);
+    if (head == tail)
+      return false;
+    const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+    user_data = cqe.user_data;
+    res = cqe.res;
+    std::atomic_ref<unsigned>(*cq_head_).store(head + 1,
+                                               std::memory_order_release);
+    in_flight_--;
+    return true;
+  }
+
+  /**
+   * @brief Wait for every submitted read to complete, and discard the
+   * completions not reaped yet. Reads queued but not submitted never will
+   * be. For error paths, so that the reads' buffers may be freed after.
+   */
+  void Drain()
+  {
+    uint64_t user_data;
+    int res;
+    while (true)
+    {
+      while (Reap(user_data, res))
+        ;
+      if (in_flight_ == 0)
+        return;
+      if (::syscall(__NR_io_uring_enter, ring_fd_, 0, in_flight_,
+                    IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+          errno != EINTR)
+        // The kernel would go on writing to the buffers: better to stop.
+        std::abort();
+    }
+  }
+
+private:
+  int ring_fd_;
+  bool single_mmap_;
+  size_t sq_bytes_, cq_bytes_, sqes_bytes_;
+  void *sq_ = nullptr;
+  void *cq_ = nullptr;
+  struct io_uring_sqe *sqes_ = nullptr;
+
+  unsigned *sq_head_, *sq_tail_, *sq_array_;
+  unsigned sq_mask_, sq_entries_;
+  unsigned *cq_head_, *cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe *cqes_;
+
+  // Queued but not yet submitted, and submitted but not yet reaped.
+  unsigned queued_ = 0;
+  unsigned in_flight_ = 0;
+
+  void Close()
+  {
+    if (sqes_)
+      ::munmap(sqes_, sqes_bytes_);
+    if (cq_ && cq_ != sq_)
+      ::munmap(cq_, cq_bytes_);
+    if (sq_)
+      ::munmap(sq_, sq_bytes_);
+    ::close(ring_fd_);
+  }
+
+  void *Map(size_t bytes, off_t offset)
+  {
+    void *addr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    if (addr == MAP_FAILED)
+    {
+      int error = errno;
+      Close();
+      throw std::system_error(error, std::generic_category(), "mmap");
+    }
+    return addr;
+  }
+};
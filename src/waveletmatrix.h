@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "segtree.h"
+
+/**
+ * @brief A static bit vector with constant time rank: one popcount on top of
+ * a cumulative count per 64-bit word.
+ */
+class BitVector
+{
+public:
+  BitVector() = default;
+
+  BitVector(int size) : size_(size), words_(size / 64 + 1, 0) {}
+
+  void Set(int i) { words_[i / 64] |= uint64_t(1) << (i % 64); }
+
+  bool Get(int i) const { return words_[i / 64] >> (i % 64) & 1; }
+
+  // Call once every bit is set.
+  void BuildRank()
+  {
+    ranks_.resize(words_.size());
+    int count = 0;
+    for (size_t w = 0; w < words_.size(); w++)
+    {
+      ranks_[w] = count;
+      count += std::popcount(words_[w]);
+    }
+  }
+
+  // Ones in [0, i).
+  int Rank1(int i) const
+  {
+    uint64_t below = words_[i / 64] & ((uint64_t(1) << (i % 64)) - 1);
+    return ranks_[i / 64] + std::popcount(below);
+  }
+
+  // Zeros in [0, i).
+  int Rank0(int i) const { return i - Rank1(i); }
+
+  int size() const { return size_; }
+
+private:
+  int size_ = 0;
+  std::vector<uint64_t> words_;
+  std::vector<int> ranks_;
+};
+
+/**
+ * @brief Order statistics over a static array: the k-th smallest value, and
+ * the number of values below x, in any range, in O(log sigma) rank queries
+ * where sigma is the number of distinct values.
+ *
+ * Values are replaced by their rank among the distinct values, and level b
+ * of the matrix stores bit b of every such code, with each level stably
+ * partitioned by the bit above it (zeros first).
+ */
+class WaveletMatrix
+{
+public:
+  WaveletMatrix(const std::vector<int> &arr)
+  {
+    size_ = arr.size();
+    values_ = arr;
+    std::sort(values_.begin(), values_.end());
+    values_.erase(std::unique(values_.begin(), values_.end()), values_.end());
+
+    std::vector<int> codes(size_), next(size_);
+    for (int i = 0; i < size_; i++)
+      codes[i] = Code(arr[i]);
+
+    int bits = std::bit_width(values_.empty() ? 0u : values_.size() - 1);
+    levels_.resize(bits);
+    zeros_.resize(bits);
+    for (int b = bits - 1; b >= 0; b--)
+    {
+      BitVector &level = levels_[b];
+      level = BitVector(size_);
+      for (int i = 0; i < size_; i++)
+        if (codes[i] >> b & 1)
+          level.Set(i);
+      level.BuildRank();
+      zeros_[b] = level.Rank0(size_);
+
+      // Stable partition for the next level: zeros, then ones.
+      auto it = std::copy_if(codes.begin(), codes.end(), next.begin(),
+                             [b](int c) { return !(c >> b & 1); });
+      std::copy_if(codes.begin(), codes.end(), it,
+                   [b](int c) { return c >> b & 1; });
+      codes.swap(next);
+    }
+  }
+
+  /**
+   * @brief The k-th smallest value (from 0) in domain.
+   * Requires 0 <= k < domain.Volume().
+   */
+  int KthSmallest(Cube domain, int k) const
+  {
+    auto [l, r] = domain;
+    int code = 0;
+    for (int b = levels_.size() - 1; b >= 0; b--)
+    {
+      int l0 = levels_[b].Rank0(l), r0 = levels_[b].Rank0(r);
+      if (k < r0 - l0)
+      {
+        l = l0;
+        r = r0;
+      }
+      else
+      {
+        k -= r0 - l0;
+        code |= 1 << b;
+        l = zeros_[b] + l - l0;
+        r = zeros_[b] + r - r0;
+      }
+    }
+    return values_[code];
+  }
+
+  // Number of values in domain strictly less than x.
+  int CountLess(Cube domain, int x) const
+  {
+    auto [l, r] = domain;
+    int code = Code(x);
+    if (code == int(values_.size()))
+      return r - l;
+
+    int count = 0;
+    for (int b = levels_.size() - 1; b >= 0; b--)
+    {
+      int l0 = levels_[b].Rank0(l), r0 = levels_[b].Rank0(r);
+      if (code >> b & 1)
+      {
+        count += r0 - l0;
+        l = zeros_[b] + l - l0;
+        r = zeros_[b] + r - r0;
+      }
+      else
+      {
+        l = l0;
+        r = r0;
+      }
+    }
+    return count;
+  }
+
+  int size() const { return size_; }
+
+private:
+  int size_;
+  // The distinct values, sorted: code c stands for values_[c].
+  std::vector<int> values_;
+  // levels_[b] holds bit b of the codes, in that level's order.
+  std::vector<BitVector> levels_;
+  // Zeros in levels_[b].
+  std::vector<int> zeros_;
+
+  // Rank of x among the distinct values.
+  int Code(int x) const
+  {
+    return std::lower_bound(values_.begin(), values_.end(), x) -
+           values_.begin();
+  }
+};
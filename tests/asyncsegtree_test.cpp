@@ -0,0 +1,108 @@
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "asyncsegtree.h"
+#include "check.h"
+
+int main()
+{
+  std::mt19937 rng(76);
+
+  // Single producer, against a reference array: flushed queries see every
+  // update before them, stale ones those applied by the last flush.
+  for (int it = 0; it < 100; it++)
+  {
+    int n = rng() % 500 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = rng() % 10;
+    std::vector<int> flushed = arr;
+    AsyncSegmentTree tree(arr);
+    for (int q = 0; q < 500; q++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      // Repeated ranges, so that queued updates combine.
+      if (rng() % 2)
+      {
+        l = 0;
+        r = n;
+      }
+      int type = rng() % 6, val = rng() % 10;
+      if (type == 0)
+      {
+        tree.AssignRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] = val;
+      }
+      else if (type <= 2)
+      {
+        tree.AddToRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] += val;
+      }
+      else if (type == 3)
+      {
+        int sum = 0;
+        for (int i = l; i < r; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange({l, r}) == sum);
+        flushed = arr;
+      }
+      else if (type == 4)
+      {
+        int sum = 0;
+        for (int i = l; i < r; i++)
+          sum += flushed[i];
+        CHECK(tree.QueryRange({l, r}, ReadMode::kStale) == sum);
+      }
+      else
+      {
+        while (tree.Flush(rng() % 4 + 1) > 0)
+          ;
+        flushed = arr;
+      }
+    }
+  }
+
+  // Concurrent producers, and a consumer flushing as they go: every update
+  // lands.
+  {
+    int n = 1000;
+    AsyncSegmentTree tree(std::vector<int>(n, 0));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+      threads.emplace_back(
+          [&tree, n, t]
+          {
+            std::mt19937 rng(t);
+            for (int i = 0; i < 20000; i++)
+            {
+              int l = rng() % n;
+              tree.AddToRange({l, std::min(n, l + 10)}, 1);
+            }
+          });
+    for (int i = 0; i < 1000; i++)
+      tree.QueryRange({0, n}, i % 2 ? ReadMode::kStale : ReadMode::kFlushed);
+    for (std::thread &thread : threads)
+      thread.join();
+    std::vector<int> arr(n, 0);
+    for (int t = 0; t < 4; t++)
+    {
+      std::mt19937 rng(t);
+      for (int i = 0; i < 20000; i++)
+      {
+        int l = rng() % n;
+        for (int j = l; j < std::min(n, l + 10); j++)
+          arr[j]++;
+      }
+    }
+    for (int i = 0; i < n; i++)
+      CHECK(tree.Get(i) == arr[i]);
+    CHECK(tree.watermark() == 4 * 20000);
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "atomicsegtree.h"
+#include "check.h"
+
+int main()
+{
+  std::mt19937 rng(91);
+
+  // Single threaded, against a reference array.
+  for (int it = 0; it < 300; it++)
+  {
+    int n = rng() % 100 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = rng() % 100;
+    AtomicSegmentTree tree(arr);
+    for (int q = 0; q < 300; q++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      if (rng() % 2)
+      {
+        int inc = int(rng() % 20) - 10;
+        tree.AddToRange({l, r}, inc);
+        for (int i = l; i < r; i++)
+          arr[i] += inc;
+      }
+      else
+      {
+        int sum = 0;
+        for (int i = l; i < r; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange({l, r}) == sum);
+      }
+    }
+  }
+
+  // Concurrent updates all land.
+  {
+    int n = 1 << 14;
+    AtomicSegmentTree tree(std::vector<int>(n, 0));
+    std::vector<std::vector<std::pair<Cube, int>>> logs(4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+      threads.emplace_back(
+          [&tree, &logs, n, t]
+          {
+            std::mt19937 rng(t);
+            for (int i = 0; i < 20000; i++)
+            {
+              int l = rng() % n, r = rng() % n;
+              if (l > r)
+                std::swap(l, r);
+              r++;
+              if (i % 2)
+              {
+                int inc = rng() % 5;
+                tree.AddToRange({l, r}, inc);
+                logs[t].push_back({{l, r}, inc});
+              }
+              else
+                tree.QueryRange({l, r});
+            }
+          });
+    for (std::thread &thread : threads)
+      thread.join();
+    std::vector<int> diff(n + 1);
+    for (const auto &log : logs)
+      for (const auto &[domain, inc] : log)
+      {
+        diff[domain.l] += inc;
+        diff[domain.r] -= inc;
+      }
+    int value = 0;
+    for (int i = 0; i < n; i++)
+    {
+      value += diff[i];
+      CHECK(tree.Get(i) == value);
+    }
+  }
+
+  // Queries are linearizable: each update adds 1 to the whole of a range
+  // spanning many nodes, so a query of that range only ever sees multiples
+  // of its size, in increasing order.
+  {
+    int n = 1000;
+    Cube range = {1, n - 3};
+    AtomicSegmentTree tree(std::vector<int>(n, 0));
+    std::atomic<bool> done = false;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; t++)
+      threads.emplace_back(
+          [&tree, &done, range]
+          {
+            for (int i = 0; i < 20000; i++)
+              tree.AddToRange(range, 1);
+            done = true;
+          });
+    // Also ranges overlapping it in part, which read the tags of nodes the
+    // updates cover, and ranges disjoint from it.
+    Cube overlap = {range.l + 100, n}, disjoint = {n - 2, n};
+    int overlap_volume = range.r - overlap.l;
+    int last = 0, last_overlap = 0;
+    while (!done)
+    {
+      int sum = tree.QueryRange(range);
+      CHECK(sum % range.Volume() == 0 && sum >= last);
+      last = sum;
+      sum = tree.QueryRange(overlap);
+      CHECK(sum % overlap_volume == 0 && sum >= last_overlap);
+      last_overlap = sum;
+      CHECK(tree.QueryRange(disjoint) == 0);
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+    CHECK(tree.QueryRange(range) == 3 * 20000 * range.Volume());
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "cachedsegtree.h"
+#include "check.h"
+
+static Cube RandomRange(std::mt19937 &rng, int n)
+{
+  int l = rng() % n, r = rng() % n;
+  if (l > r)
+    std::swap(l, r);
+  return {l, r + 1};
+}
+
+int main()
+{
+  std::mt19937 rng(90);
+
+  // A few hot ranges between updates, against a reference array, with
+  // caches small enough for entries to collide.
+  for (int it = 0; it < 200; it++)
+  {
+    int n = rng() % 1000 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = int(rng() % 20) - 10;
+    CachedSegmentTree tree(arr, rng() % 64);
+    std::vector<Cube> hot(rng() % 20 + 1);
+    for (Cube &domain : hot)
+      domain = RandomRange(rng, n);
+    uint64_t queries = 0;
+    for (int q = 0; q < 500; q++)
+    {
+      int type = rng() % 10;
+      Cube domain = rng() % 2 ? hot[rng() % hot.size()] : RandomRange(rng, n);
+      int val = int(rng() % 20) - 10;
+      if (type == 0)
+      {
+        tree.AddToRange(domain, val);
+        for (int i = domain.l; i < domain.r; i++)
+          arr[i] += val;
+      }
+      else if (type == 1)
+      {
+        tree.AssignRange(domain, val);
+        for (int i = domain.l; i < domain.r; i++)
+          arr[i] = val;
+      }
+      else
+      {
+        int sum = 0;
+        for (int i = domain.l; i < domain.r; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange(domain) == sum);
+        queries++;
+      }
+    }
+    CHECK(tree.hits() + tree.misses() == queries);
+  }
+
+  // An update outside a cached range keeps it fresh; one overlapping it,
+  // even by one element, does not.
+  {
+    int n = 1000;
+    CachedSegmentTree tree(std::vector<int>(n, 1));
+    CHECK(tree.QueryRange({100, 500}) == 400);
+    tree.AddToRange({500, 900}, 1);
+    tree.AddToRange({0, 100}, 1);
+    CHECK(tree.QueryRange({100, 500}) == 400);
+    CHECK(tree.hits() == 1 && tree.misses() == 1);
+    tree.AddToRange({499, 500}, 1);
+    CHECK(tree.QueryRange({100, 500}) == 401);
+    CHECK(tree.hits() == 1 && tree.misses() == 2);
+  }
+  return 0;
+}
@@ -0,0 +1,231 @@
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+#include "checkpoint.h"
+
+// An anonymous temporary file, closed at exit.
+static int TempFile()
+{
+  std::FILE *file = std::tmpfile();
+  CHECK(file != nullptr);
+  return fileno(file);
+}
+
+static void Rewind(int fd) { CHECK(::lseek(fd, 0, SEEK_SET) == 0); }
+
+static void RandomUpdates(std::mt19937 &rng, SegmentTree &tree,
+                          std::vector<int> &arr, int count, int max_len)
+{
+  int n = arr.size();
+  for (int q = 0; q < count; q++)
+  {
+    int l = rng() % n;
+    int r = std::min<int>(n, l + 1 + rng() % max_len);
+    int val = rng() % 10;
+    if (q % 2)
+    {
+      tree.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] += val;
+    }
+    else
+    {
+      tree.AssignRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] = val;
+    }
+  }
+}
+
+static void CheckEqual(SegmentTree &tree, const std::vector<int> &arr)
+{
+  int n = arr.size();
+  CHECK(tree.size() == n);
+  for (int i = 0; i < n; i += 97)
+  {
+    int r = std::min(n, i + 1000);
+    int sum = 0;
+    for (int j = i; j < r; j++)
+      sum += arr[j];
+    CHECK(tree.QueryRange({i, r}) == sum);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(95);
+  int n = 100000;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = rng() % 10;
+  SegmentTree tree(arr);
+  RandomUpdates(rng, tree, arr, 500, 5000);
+
+  int base = TempFile();
+  WriteCheckpoint(tree, base);
+  off_t base_end = ::lseek(base, 0, SEEK_CUR);
+
+  std::vector<int> deltas;
+  for (int k = 0; k < 3; k++)
+  {
+    RandomUpdates(rng, tree, arr, 50, 100);
+    deltas.push_back(TempFile());
+    WriteIncrementalCheckpoint(tree, deltas.back());
+    // Only the pages changed are written.
+    CHECK(::lseek(deltas.back(), 0, SEEK_CUR) < base_end / 4);
+  }
+
+  for (int parallelism : {1, 2, 8})
+    for (int chunk_bytes : {4096, 65536, 1 << 20})
+      for (bool verify : {false, true})
+      {
+        Rewind(base);
+        for (int fd : deltas)
+          Rewind(fd);
+        RestoreOptions options;
+        options.parallelism = parallelism;
+        options.chunk_bytes = chunk_bytes;
+        options.verify = verify;
+        SegmentTree restored = RestoreCheckpoint(base, deltas, options);
+        CheckEqual(restored, arr);
+        // The restored tree goes on checkpointing the chain.
+        if (parallelism == 1 && chunk_bytes == 4096 && !verify)
+        {
+          int delta = TempFile();
+          std::vector<int> copy = arr;
+          RandomUpdates(rng, restored, copy, 10, 100);
+          WriteIncrementalCheckpoint(restored, delta);
+          Rewind(base);
+          for (int fd : deltas)
+            Rewind(fd);
+          Rewind(delta);
+          std::vector<int> chain = deltas;
+          chain.push_back(delta);
+          SegmentTree again = RestoreCheckpoint(base, chain);
+          CheckEqual(again, copy);
+        }
+      }
+
+  // A delta out of order breaks the chain.
+  Rewind(base);
+  Rewind(deltas[1]);
+  bool threw = false;
+  try
+  {
+    RestoreCheckpoint(base, std::vector<int>{deltas[1]});
+  }
+  catch (const std::runtime_error &)
+  {
+    threw = true;
+  }
+  CHECK(threw);
+
+  // A fork continues its origin's chain in a lineage of its own: its deltas
+  // apply on top of the checkpoints before the fork, and never mix with the
+  // origin's deltas of the same generations.
+  {
+    std::vector<int> fork_arr = arr;
+    SegmentTree fork = tree.Fork();
+    std::vector<int> origin_deltas, fork_deltas;
+    for (int k = 0; k < 2; k++)
+    {
+      RandomUpdates(rng, tree, arr, 10, 100);
+      origin_deltas.push_back(TempFile());
+      WriteIncrementalCheckpoint(tree, origin_deltas.back());
+      RandomUpdates(rng, fork, fork_arr, 10, 100);
+      fork_deltas.push_back(TempFile());
+      WriteIncrementalCheckpoint(fork, fork_deltas.back());
+    }
+    auto Restore = [&](std::vector<int> chain)
+    {
+      Rewind(base);
+      for (int fd : chain)
+        Rewind(fd);
+      return RestoreCheckpoint(base, chain);
+    };
+    std::vector<int> chain = deltas;
+    chain.insert(chain.end(), fork_deltas.begin(), fork_deltas.end());
+    SegmentTree restored = Restore(chain);
+    CheckEqual(restored, fork_arr);
+    for (int k = 0; k < 2; k++)
+    {
+      // Generations in sequence, lineages crossed.
+      chain = deltas;
+      chain.push_back(k == 0 ? origin_deltas[0] : fork_deltas[0]);
+      chain.push_back(k == 0 ? fork_deltas[1] : origin_deltas[1]);
+      threw = false;
+      try
+      {
+        Restore(chain);
+      }
+      catch (const std::runtime_error &)
+      {
+        threw = true;
+      }
+      CHECK(threw);
+    }
+  }
+
+  // A flipped bit is caught by verify, sequentially and in parallel.
+  char byte;
+  CHECK(::pread(base, &byte, 1, base_end - 5000) == 1);
+  byte ^= 1;
+  CHECK(::pwrite(base, &byte, 1, base_end - 5000) == 1);
+  for (int parallelism : {1, 4})
+  {
+    Rewind(base);
+    RestoreOptions options;
+    options.parallelism = parallelism;
+    options.verify = true;
+    threw = false;
+    try
+    {
+      RestoreCheckpoint(base, {}, options);
+    }
+    catch (const std::runtime_error &)
+    {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+
+  // So is a truncated checkpoint, verified or not, cut short at the end or
+  // early on, with many reads still in flight when the short one fails.
+  for (off_t end : {base_end - 100, base_end / 8})
+    for (int parallelism : {1, 4, 32})
+    {
+      CHECK(::ftruncate(base, end) == 0);
+      Rewind(base);
+      RestoreOptions options;
+      options.parallelism = parallelism;
+      options.chunk_bytes = 4096;
+      threw = false;
+      try
+      {
+        RestoreCheckpoint(base, {}, options);
+      }
+      catch (const std::exception &)
+      {
+        threw = true;
+      }
+      CHECK(threw);
+    }
+
+  // Lazily built trees are built before they are written.
+  std::vector<int> lazy_arr(3000);
+  for (int &x : lazy_arr)
+    x = rng() % 100;
+  SegmentTree lazy = SegmentTree::BuildLazily(lazy_arr);
+  RandomUpdates(rng, lazy, lazy_arr, 20, 100);
+  int lazy_fd = TempFile();
+  WriteCheckpoint(lazy, lazy_fd);
+  Rewind(lazy_fd);
+  SegmentTree restored = RestoreCheckpoint(lazy_fd);
+  CheckEqual(restored, lazy_arr);
+  return 0;
+}
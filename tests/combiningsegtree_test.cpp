@@ -0,0 +1,108 @@
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "combiningsegtree.h"
+
+int main()
+{
+  std::mt19937 rng(92);
+
+  // Single threaded, against a reference array, with another tree alive in
+  // the same thread and left untouched.
+  for (int it = 0; it < 100; it++)
+  {
+    int n = rng() % 500 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = rng() % 10;
+    CombiningSegmentTree tree(arr), other(arr);
+    int total = 0;
+    for (int x : arr)
+      total += x;
+    for (int q = 0; q < 200; q++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      int type = rng() % 3, val = rng() % 10;
+      if (type == 0)
+      {
+        tree.AddToRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] += val;
+      }
+      else if (type == 1)
+      {
+        tree.AssignRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] = val;
+      }
+      else
+      {
+        int sum = 0;
+        for (int i = l; i < r; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange({l, r}) == sum);
+      }
+    }
+    CHECK(other.QueryRange({0, n}) == total);
+  }
+
+  // One thread cycling through more trees than its slot cache holds, some
+  // of them replaced by new trees at the same address on the way.
+  {
+    int n = 100;
+    std::vector<std::unique_ptr<CombiningSegmentTree>> trees;
+    std::vector<int> totals(10, 0);
+    for (int t = 0; t < 10; t++)
+      trees.push_back(
+          std::make_unique<CombiningSegmentTree>(std::vector<int>(n, 0)));
+    for (int q = 0; q < 2000; q++)
+    {
+      int t = rng() % trees.size();
+      if (rng() % 50 == 0)
+      {
+        trees[t].reset();
+        trees[t] =
+            std::make_unique<CombiningSegmentTree>(std::vector<int>(n, 0));
+        totals[t] = 0;
+      }
+      int l = rng() % n;
+      trees[t]->AddToRange({l, l + 1}, 1);
+      totals[t]++;
+      CHECK(trees[t]->QueryRange({0, n}) == totals[t]);
+    }
+  }
+
+  // Concurrent updates and queries are linearizable: each update adds 1 to
+  // the whole of a range, so queries of it see multiples of its size, in
+  // increasing order per thread, and every update lands.
+  {
+    int n = 1000;
+    Cube range = {3, n - 1};
+    CombiningSegmentTree tree(std::vector<int>(n, 0));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+      threads.emplace_back(
+          [&tree, range]
+          {
+            int last = 0;
+            for (int i = 0; i < 10000; i++)
+            {
+              tree.AddToRange(range, 1);
+              int sum = tree.QueryRange(range);
+              CHECK(sum % range.Volume() == 0 && sum > last);
+              last = sum;
+            }
+          });
+    for (std::thread &thread : threads)
+      thread.join();
+    CHECK(tree.QueryRange(range) == 4 * 10000 * range.Volume());
+    CHECK(tree.QueryRange({0, n}) == 4 * 10000 * range.Volume());
+  }
+  return 0;
+}
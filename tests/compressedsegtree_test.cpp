@@ -0,0 +1,79 @@
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "compressedsegtree.h"
+
+// Random updates and queries against a reference array, with a cache of
+// cache_blocks blocks.
+static void TestRandom(std::mt19937 &rng, int n, int cache_blocks)
+{
+  // Runs of equal values, and the occasional outlier of any width.
+  std::vector<int> arr(n);
+  int value = 0;
+  for (int &x : arr)
+  {
+    if (rng() % 50 == 0)
+      value = int(rng() % 1000) - 500;
+    x = rng() % 100 == 0 ? int(rng() % (1 << 24)) - (1 << 23) : value;
+  }
+  CompressedSegmentTree tree(arr, cache_blocks);
+  for (int q = 0; q < 500; q++)
+  {
+    int l = rng() % n, r = rng() % n;
+    if (l > r)
+      std::swap(l, r);
+    r++;
+    if (rng() % 2)
+      r = std::min(n, l + int(rng() % 200) + 1);
+    int type = rng() % 4, val = int(rng() % 100) - 50;
+    if (type == 0)
+    {
+      tree.AssignRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] = val;
+    }
+    else if (type == 1)
+    {
+      tree.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] += val;
+    }
+    else
+    {
+      int sum = 0;
+      for (int i = l; i < r; i++)
+        sum += arr[i];
+      CHECK(tree.QueryRange({l, r}) == sum);
+      int i = rng() % n;
+      CHECK(tree.Get(i) == arr[i]);
+    }
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(82);
+  for (int it = 0; it < 100; it++)
+  {
+    int n = it % 5 == 0 ? (rng() % 8 + 1) * CompressedSegmentTree::kBlockSize
+                        : rng() % 5000 + 1;
+    TestRandom(rng, n, it % 3 == 0 ? 1 : rng() % 8 + 1);
+  }
+
+  // Empty trees and ranges.
+  CompressedSegmentTree empty(std::vector<int>{});
+  CHECK(empty.size() == 0 && empty.QueryRange({0, 0}) == 0);
+  empty.AddToRange({0, 0}, 1);
+  CompressedSegmentTree small(std::vector<int>(300, 1));
+  small.AssignRange({200, 200}, 5);
+  CHECK(small.QueryRange({130, 130}) == 0);
+  CHECK(small.QueryRange({0, 300}) == 300);
+
+  // A constant array packs into a fraction of its size.
+  int n = 1 << 20;
+  CompressedSegmentTree constant(std::vector<int>(n, 42), 4);
+  CHECK(constant.MemoryUsage() < n * sizeof(int) / 4);
+  CHECK(constant.QueryRange({0, n}) == 42 * n);
+  return 0;
+}
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "check.h"
+#include "coversegtree.h"
+
+// Random additions and removals of intervals over random breakpoints,
+// against a count per leaf.
+static void TestCover(std::mt19937 &rng)
+{
+  int n = rng() % 200 + 1;
+  std::set<long long> distinct;
+  while (int(distinct.size()) < n + 1)
+    distinct.insert(int(rng() % 100000) - 50000);
+  std::vector<long long> breakpoints(distinct.begin(), distinct.end());
+  CoverSegmentTree tree(breakpoints);
+  CHECK(tree.size() == n);
+
+  std::vector<int> count(n, 0);
+  std::vector<Cube> added;
+  for (int q = 0; q < 300; q++)
+  {
+    if (added.empty() || rng() % 3)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      added.push_back({l, r + 1});
+      tree.Add(added.back());
+      for (int i = l; i <= r; i++)
+        count[i]++;
+    }
+    else
+    {
+      int j = rng() % added.size();
+      std::swap(added[j], added.back());
+      Cube domain = added.back();
+      added.pop_back();
+      tree.Remove(domain);
+      for (int i = domain.l; i < domain.r; i++)
+        count[i]--;
+    }
+
+    auto Covered = [&](int l, int r)
+    {
+      long long length = 0;
+      for (int i = l; i < r; i++)
+        if (count[i] > 0)
+          length += breakpoints[i + 1] - breakpoints[i];
+      return length;
+    };
+    CHECK(tree.CoveredLength() == Covered(0, n));
+    int l = rng() % n, r = rng() % n;
+    if (l > r)
+      std::swap(l, r);
+    CHECK(tree.CoveredLength({l, r + 1}) == Covered(l, r + 1));
+    CHECK(tree.CoveredLength({l, l}) == 0);
+  }
+}
+
+// Random rectangles on a small grid, against the grid's covered cells.
+static void TestUnionArea(std::mt19937 &rng)
+{
+  int side = rng() % 30 + 1;
+  std::vector<Rectangle> rectangles(rng() % 20);
+  std::vector<std::vector<bool>> grid(side, std::vector<bool>(side, false));
+  for (Rectangle &rect : rectangles)
+  {
+    // Empty and inverted rectangles too.
+    rect = {int(rng() % side), int(rng() % side), int(rng() % side),
+            int(rng() % side)};
+    for (int x = rect.x1; x < rect.x2; x++)
+      for (int y = rect.y1; y < rect.y2; y++)
+        grid[x][y] = true;
+  }
+  long long area = 0;
+  for (const auto &column : grid)
+    area += std::count(column.begin(), column.end(), true);
+  CHECK(UnionArea(rectangles) == area);
+}
+
+int main()
+{
+  std::mt19937 rng(87);
+  for (int it = 0; it < 200; it++)
+  {
+    TestCover(rng);
+    TestUnionArea(rng);
+  }
+
+  // Areas beyond 32 bits.
+  CHECK(UnionArea({{0, 0, INT_MAX, INT_MAX}, {-1, -1, 1, 1}}) ==
+        (long long)INT_MAX * INT_MAX + 3);
+  CHECK(UnionArea({{0, 0, 2, 1000000000}, {1, 0, 3, 1000000000}}) ==
+        3000000000ll);
+  CHECK(UnionArea({}) == 0);
+
+  // Empty intervals, on an empty tree and at the edges of another.
+  CoverSegmentTree empty(0);
+  empty.Add({0, 0});
+  empty.Remove({0, 0});
+  CHECK(empty.CoveredLength() == 0 && empty.CoveredLength({0, 0}) == 0);
+  CoverSegmentTree tree(10);
+  for (int edge : {0, 10})
+  {
+    tree.Add({edge, edge});
+    CHECK(tree.CoveredLength() == 0);
+    tree.Remove({edge, edge});
+  }
+  return 0;
+}
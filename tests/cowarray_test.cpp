@@ -0,0 +1,137 @@
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "cowarray.h"
+#include "segtree.h"
+
+using Array = CowArray<int>;
+
+// An array with a reference copy, and the pages written since ClearDirty.
+struct Model
+{
+  Array array;
+  std::vector<int> values;
+  std::set<int> dirty;
+};
+
+static void CheckModel(const Model &model)
+{
+  const Array &array = model.array;
+  CHECK(array.size() == int(model.values.size()));
+  for (int i = 0; i < array.size(); i++)
+    CHECK(array[i] == model.values[i]);
+  for (int p = 0; p < array.num_pages(); p++)
+    CHECK(!model.dirty.count(p) || array.IsDirty(p));
+}
+
+// Random writes, reads, forks, copies and ClearDirty over a family of
+// arrays sharing pages, against deep copies.
+static void TestRandom(std::mt19937 &rng, Array first, int size)
+{
+  std::vector<Model> models;
+  models.push_back({std::move(first), std::vector<int>(size, 7), {}});
+  for (int q = 0; q < 2000; q++)
+  {
+    Model &model = models[rng() % models.size()];
+    int op = rng() % 20;
+    if (op == 0 && models.size() < 8)
+    {
+      Model fork = {model.array.Fork(), model.values, model.dirty};
+      models.push_back(std::move(fork));
+    }
+    else if (op == 1 && models.size() < 8)
+    {
+      Model copy = {model.array, model.values, model.dirty};
+      models.push_back(std::move(copy));
+    }
+    else if (op == 2)
+    {
+      model.array.ClearDirty();
+      model.dirty.clear();
+      for (int p = 0; p < model.array.num_pages(); p++)
+        CHECK(!model.array.IsDirty(p));
+    }
+    else if (op == 3 && models.size() > 1)
+    {
+      models.erase(models.begin() + (&model - models.data()));
+      continue;
+    }
+    else if (size > 0)
+    {
+      // Runs of writes, as a tree's traversals do.
+      int i = rng() % size;
+      for (int k = 0; k < 20 && i < size; k++, i += rng() % 3)
+      {
+        int val = rng();
+        model.array[i] = val;
+        model.values[i] = val;
+        model.dirty.insert(i >> Array::kPageShift);
+      }
+    }
+    for (const Model &other : models)
+      CheckModel(other);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(78);
+  for (int size : {0, 1, 1000, 1024, 1025, 5000})
+  {
+    TestRandom(rng, Array(size, 7), size);
+    TestRandom(rng, Array::Sparse(size, 7), size);
+    std::vector<int> storage((size + Array::kPageMask) & ~Array::kPageMask, 7);
+    TestRandom(rng, Array(storage.data(), size), size);
+  }
+
+  // Forks of a tree, each against its own reference array.
+  for (int it = 0; it < 100; it++)
+  {
+    int n = rng() % 3000 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = rng() % 10;
+    std::vector<SegmentTree> trees;
+    std::vector<std::vector<int>> arrs;
+    trees.push_back(it % 2 ? SegmentTree(arr) : SegmentTree::BuildLazily(arr));
+    arrs.push_back(arr);
+    for (int q = 0; q < 200; q++)
+    {
+      int t = rng() % trees.size();
+      if (rng() % 20 == 0)
+      {
+        trees.push_back(trees[t].Fork());
+        arrs.push_back(arrs[t]);
+        continue;
+      }
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      int type = rng() % 3, val = rng() % 10;
+      if (type == 0)
+      {
+        trees[t].AddToRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arrs[t][i] += val;
+      }
+      else if (type == 1)
+      {
+        trees[t].AssignRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arrs[t][i] = val;
+      }
+      else
+      {
+        int sum = 0;
+        for (int i = l; i < r; i++)
+          sum += arrs[t][i];
+        CHECK(trees[t].QueryRange({l, r}) == sum);
+      }
+    }
+  }
+  return 0;
+}
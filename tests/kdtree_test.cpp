@@ -0,0 +1,70 @@
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "kdtree.h"
+
+// Compare weighted counts with a scan over every point, in a space 2^33
+// wide so that the 64-bit coordinates are exercised.
+template <int n> void TestRandom(std::mt19937_64 &rng, int size)
+{
+  using Tree = KdTree<n>;
+  const int64_t lo = -(int64_t(1) << 32), hi = int64_t(1) << 32;
+  std::uniform_int_distribution<int64_t> coord(lo, hi - 1);
+  std::uniform_int_distribution<int> weight(-5, 20);
+
+  std::vector<typename Tree::Point> points(size);
+  std::vector<int> weights(size);
+  for (int i = 0; i < size; i++)
+  {
+    for (int d = 0; d < n; d++)
+      // Some duplicates, to cut ties at the median.
+      points[i][d] = rng() % 4 == 0 && i > 0 ? points[i - 1][d] : coord(rng);
+    weights[i] = weight(rng);
+  }
+  Tree tree(points, weights);
+  CHECK(tree.size() == size);
+
+  for (int q = 0; q < 300; q++)
+  {
+    typename Tree::Box box;
+    for (int d = 0; d < n; d++)
+    {
+      int64_t a = coord(rng), b = coord(rng);
+      if (q % 10 == 0 && size > 0)
+        a = points[rng() % size][d];
+      box.l[d] = std::min(a, b);
+      box.r[d] = std::max(a, b) + 1;
+    }
+    long long expected = 0;
+    for (int i = 0; i < size; i++)
+    {
+      bool in = true;
+      for (int d = 0; d < n; d++)
+        in &= box.l[d] <= points[i][d] && points[i][d] < box.r[d];
+      expected += in ? weights[i] : 0;
+    }
+    CHECK(tree.QueryRange(box) == expected);
+  }
+}
+
+int main()
+{
+  std::mt19937_64 rng(84);
+  for (int size : {0, 1, 31, 32, 33, 100, 1000, 5000})
+  {
+    TestRandom<1>(rng, size);
+    TestRandom<2>(rng, size);
+    TestRandom<3>(rng, size);
+  }
+
+  // Cube<n> queries, with default weights.
+  std::vector<KdTree<2>::Point> points;
+  for (int x = 0; x < 40; x++)
+    for (int y = 0; y < 40; y++)
+      points.push_back({x, y});
+  KdTree<2> tree(points);
+  CHECK(tree.QueryRange(Cube<2>{{3, 5}, {13, 25}}) == 10 * 20);
+  CHECK(tree.QueryRange(Cube<2>{{-10, -10}, {100, 100}}) == 40 * 40);
+  return 0;
+}
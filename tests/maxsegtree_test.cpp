@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "check.h"
+#include "maxsegtree.h"
+
+// Random updates, range max and TopK queries against a reference array.
+static void TestRandom(std::mt19937 &rng, int n)
+{
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = int(rng() % 1000) - 500;
+  MaxSegmentTree tree(arr);
+  for (int q = 0; q < 500; q++)
+  {
+    int l = rng() % n, r = rng() % n;
+    if (l > r)
+      std::swap(l, r);
+    r++;
+    int type = rng() % 5, val = int(rng() % 100) - 50;
+    if (type == 0)
+    {
+      tree.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] += val;
+    }
+    else if (type == 1)
+    {
+      tree.AssignRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] = val;
+    }
+    else if (type == 2)
+    {
+      CHECK(tree.QueryRange({l, r}) ==
+            *std::max_element(arr.begin() + l, arr.begin() + r));
+      CHECK(tree.QueryRange({l, l}) == INT_MIN);
+      int i = rng() % n;
+      CHECK(tree.Get(i) == arr[i]);
+    }
+    else
+    {
+      // Ties may be reported in any order: compare the values, and check
+      // that every index is in range, distinct and has its value.
+      int k = rng() % 10;
+      auto top = tree.TopK({l, r}, k);
+      std::vector<int> expected(arr.begin() + l, arr.begin() + r);
+      std::sort(expected.begin(), expected.end(), std::greater<int>());
+      expected.resize(std::min<int>(k, expected.size()));
+      CHECK(top.size() == expected.size());
+      std::set<int> seen;
+      for (int j = 0; j < int(top.size()); j++)
+      {
+        auto [i, value] = top[j];
+        CHECK(l <= i && i < r && seen.insert(i).second);
+        CHECK(arr[i] == value && value == expected[j]);
+      }
+    }
+  }
+}
+
+// Batches and lazily built trees of the generic tree, over max.
+static void TestBasic(std::mt19937 &rng, int n)
+{
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = rng() % 1000;
+  auto tree = BasicSegmentTree<MaxNode>::BuildLazily(arr);
+  for (int q = 0; q < 100; q++)
+  {
+    std::vector<Update> batch;
+    for (int j = 0; j < 5; j++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      Operation op = {rng() % 2 == 0, int(rng() % 100) - 50};
+      batch.push_back({{l, r}, op});
+      for (int i = l; i < r; i++)
+        arr[i] = op.Evaluate(arr[i], {0, 1});
+    }
+    tree.ApplyBatch(batch);
+    int l = rng() % n, r = rng() % n;
+    if (l > r)
+      std::swap(l, r);
+    r++;
+    CHECK(tree.QueryRange({l, r}) ==
+          *std::max_element(arr.begin() + l, arr.begin() + r));
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(86);
+  for (int it = 0; it < 200; it++)
+  {
+    int n = it % 4 == 0 ? 1 << (rng() % 11) : rng() % 1000 + 1;
+    TestRandom(rng, n);
+    TestBasic(rng, n);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "momentsegtree.h"
+
+int main()
+{
+  std::mt19937 rng(100);
+
+  // Random updates, moment and variance queries against a reference array.
+  for (int it = 0; it < 300; it++)
+  {
+    int n = it % 4 == 0 ? 1 << (rng() % 9) : rng() % 300 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = int(rng() % 200) - 100;
+    MomentSegmentTree tree(arr);
+    for (int q = 0; q < 300; q++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      int type = rng() % 4, val = int(rng() % 50) - 25;
+      if (type == 0)
+      {
+        tree.AssignRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] = val;
+      }
+      else if (type == 1)
+      {
+        tree.AddToRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] += val;
+      }
+      else
+      {
+        long long sum = 0, sum2 = 0;
+        for (int i = l; i < r; i++)
+        {
+          sum += arr[i];
+          sum2 += (long long)arr[i] * arr[i];
+        }
+        Moments moments = tree.QueryRange({l, r});
+        CHECK(moments.count == r - l && moments.sum == sum &&
+              moments.sum2 == sum2);
+        double mean = double(sum) / (r - l), variance = 0;
+        for (int i = l; i < r; i++)
+          variance += (arr[i] - mean) * (arr[i] - mean);
+        variance /= r - l;
+        CHECK(std::fabs(tree.Variance({l, r}) - variance) <=
+              1e-6 * (1 + variance));
+        int i = rng() % n;
+        CHECK(tree.Get(i) == arr[i]);
+      }
+    }
+  }
+
+  // Empty trees and ranges.
+  MomentSegmentTree empty(std::vector<int>{});
+  CHECK(empty.QueryRange({0, 0}).count == 0);
+  CHECK(empty.Variance({0, 0}) == 0);
+  return 0;
+}
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <array>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "ndsegtree.h"
+
+// A reference array in the tree's layout: dimension 0 most significant.
+template <int n> struct Reference
+{
+  std::array<int, n> dims;
+  std::vector<int> values;
+
+  int Index(const std::array<int, n> &coords) const
+  {
+    int index = 0;
+    for (int k = 0; k < n; k++)
+      index = dims[k] * index + coords[k];
+    return index;
+  }
+
+  // Call fn(coords) for every point of domain, in order.
+  template <class Fn> void ForEach(const Cube<n> &domain, Fn &&fn) const
+  {
+    if (domain.IsEmpty())
+      return;
+    std::array<int, n> coords = domain.l;
+    while (true)
+    {
+      fn(coords);
+      int k = n - 1;
+      for (; k >= 0; k--)
+      {
+        if (++coords[k] < domain.r[k])
+          break;
+        coords[k] = domain.l[k];
+      }
+      if (k < 0)
+        return;
+    }
+  }
+};
+
+template <int n> Cube<n> RandomCube(std::mt19937 &rng, std::array<int, n> dims)
+{
+  Cube<n> domain;
+  for (int k = 0; k < n; k++)
+  {
+    int l = rng() % dims[k], r = rng() % dims[k];
+    if (l > r)
+      std::swap(l, r);
+    domain.l[k] = l;
+    domain.r[k] = r + 1;
+  }
+  return domain;
+}
+
+// Random updates and queries against a reference array. Values stay
+// non-negative, as ForEachNonZero requires.
+template <int n> void TestRandom(std::mt19937 &rng, std::array<int, n> dims)
+{
+  Reference<n> ref = {dims, {}};
+  int volume = 1;
+  for (int k = 0; k < n; k++)
+    volume *= dims[k];
+  ref.values.assign(volume, 0);
+  for (int i = 0; i < 5; i++)
+    ref.values[rng() % volume] = rng() % 5;
+  NdSegmentTree<n> tree(ref.values, dims);
+  for (int q = 0; q < 100; q++)
+  {
+    Cube<n> domain = RandomCube<n>(rng, dims);
+    int type = rng() % 5, val = rng() % 3;
+    if (type == 0)
+    {
+      tree.AddToRange(domain, val);
+      ref.ForEach(domain,
+                  [&](auto coords) { ref.values[ref.Index(coords)] += val; });
+    }
+    else if (type == 1)
+    {
+      tree.AssignRange(domain, 0);
+      ref.ForEach(domain,
+                  [&](auto coords) { ref.values[ref.Index(coords)] = 0; });
+    }
+    else if (type == 2)
+    {
+      int sum = 0;
+      ref.ForEach(domain,
+                  [&](auto coords) { sum += ref.values[ref.Index(coords)]; });
+      CHECK(tree.QueryRange(domain) == sum);
+      std::array<int, n> point = RandomCube<n>(rng, dims).l;
+      CHECK(tree.Get(point) == ref.values[ref.Index(point)]);
+
+      // The box [0, r), empty along some dimensions at times.
+      Cube<n> prefix = {std::array<int, n>(), domain.r};
+      if (rng() % 4 == 0)
+        prefix.r[rng() % n] = 0;
+      sum = 0;
+      ref.ForEach(prefix,
+                  [&](auto coords) { sum += ref.values[ref.Index(coords)]; });
+      CHECK(tree.QueryPrefix(prefix.r) == sum);
+    }
+    else
+    {
+      std::vector<std::pair<int, int>> found, expected;
+      tree.ForEachNonZero(domain,
+                          [&](std::array<int, n> coords, int value)
+                          { found.push_back({ref.Index(coords), value}); });
+      ref.ForEach(domain,
+                  [&](auto coords)
+                  {
+                    if (int value = ref.values[ref.Index(coords)])
+                      expected.push_back({ref.Index(coords), value});
+                  });
+      std::sort(found.begin(), found.end());
+      CHECK(found == expected);
+    }
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(85);
+  // Beyond one dimension, subdividing a side of 1 leaves empty quadrants,
+  // which the tree does not support: only cubes of side 2^k are tested.
+  for (int it = 0; it < 100; it++)
+  {
+    TestRandom<1>(rng, {int(rng() % 100) + 1});
+    int side = 1 << (rng() % 5);
+    TestRandom<2>(rng, {side, side});
+    side = 1 << (rng() % 4);
+    TestRandom<3>(rng, {side, side, side});
+  }
+  return 0;
+}
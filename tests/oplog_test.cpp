@@ -0,0 +1,237 @@
+#include <csignal>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "oplog.h"
+
+// An anonymous temporary file, closed at exit.
+static int TempFile()
+{
+  std::FILE *file = std::tmpfile();
+  CHECK(file != nullptr);
+  return fileno(file);
+}
+
+static void Rewind(int fd) { CHECK(::lseek(fd, 0, SEEK_SET) == 0); }
+
+// A copy of the file at fd, as a crash would leave it.
+static int Snapshot(int fd)
+{
+  struct stat st;
+  CHECK(::fstat(fd, &st) == 0);
+  std::vector<char> bytes(st.st_size);
+  CHECK(::pread(fd, bytes.data(), bytes.size(), 0) == st.st_size);
+  int copy = TempFile();
+  CHECK(::pwrite(copy, bytes.data(), bytes.size(), 0) == st.st_size);
+  return copy;
+}
+
+static off_t FileSize(int fd)
+{
+  struct stat st;
+  CHECK(::fstat(fd, &st) == 0);
+  return st.st_size;
+}
+
+static void RandomUpdates(std::mt19937 &rng, LoggedSegmentTree &tree,
+                          std::vector<int> &arr, int count)
+{
+  int n = arr.size();
+  for (int q = 0; q < count; q++)
+  {
+    int l = rng() % n;
+    int r = std::min<int>(n, l + 1 + rng() % 50);
+    int val = rng() % 10;
+    if (rng() % 2)
+    {
+      tree.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] += val;
+    }
+    else
+    {
+      tree.AssignRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] = val;
+    }
+  }
+}
+
+static void CheckEqual(LoggedSegmentTree &tree, const std::vector<int> &arr)
+{
+  int n = arr.size();
+  CHECK(tree.size() == n);
+  for (int i = 0; i < n; i += 7)
+  {
+    int r = std::min(n, i + 100);
+    int sum = 0;
+    for (int j = i; j < r; j++)
+      sum += arr[j];
+    CHECK(tree.QueryRange({i, r}) == sum);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(80);
+  int n = 5000;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = rng() % 10;
+
+  int log_fd = TempFile();
+  int checkpoint_fd = TempFile();
+  std::vector<int> at_checkpoint;
+  int stale_log;
+  {
+    LoggedSegmentTree tree(arr, log_fd);
+    RandomUpdates(rng, tree, arr, 300);
+    tree.Commit();
+    // A crash after the checkpoint is written, but before the log is cut,
+    // leaves the old log next to the new checkpoint.
+    stale_log = Snapshot(log_fd);
+    tree.Checkpoint(checkpoint_fd);
+    at_checkpoint = arr;
+    CHECK(FileSize(log_fd) == 0);
+    RandomUpdates(rng, tree, arr, 300);
+    tree.Commit();
+    // Uncommitted updates are lost.
+    std::vector<int> lost = arr;
+    RandomUpdates(rng, tree, lost, 10);
+  }
+
+  // Recovery from the checkpoint and the log written after it.
+  Rewind(checkpoint_fd);
+  {
+    LoggedSegmentTree tree(checkpoint_fd, log_fd);
+    CheckEqual(tree, arr);
+  }
+
+  // Recovery from the stale log skips the updates in the checkpoint, and
+  // updates after it are appended and recovered in turn.
+  Rewind(checkpoint_fd);
+  {
+    std::vector<int> expected = at_checkpoint;
+    LoggedSegmentTree tree(checkpoint_fd, stale_log);
+    CheckEqual(tree, expected);
+    RandomUpdates(rng, tree, expected, 100);
+    tree.Commit();
+    Rewind(checkpoint_fd);
+    LoggedSegmentTree again(checkpoint_fd, stale_log);
+    CheckEqual(again, expected);
+  }
+
+  // A torn tail, of garbage or of zeros, is cut off.
+  for (char fill : {'\x5a', '\0'})
+  {
+    std::vector<char> tail(100, fill);
+    CHECK(::pwrite(log_fd, tail.data(), tail.size(), FileSize(log_fd)) ==
+          ssize_t(tail.size()));
+    Rewind(checkpoint_fd);
+    LoggedSegmentTree tree(checkpoint_fd, log_fd);
+    CheckEqual(tree, arr);
+    RandomUpdates(rng, tree, arr, 50);
+    tree.Commit();
+  }
+  Rewind(checkpoint_fd);
+  {
+    LoggedSegmentTree tree(checkpoint_fd, log_fd);
+    CheckEqual(tree, arr);
+  }
+
+  // A failed commit keeps its updates pending, and the next commit writes
+  // them, over the part already written.
+  {
+    std::vector<int> expected(n, 0);
+    int log = TempFile(), checkpoint = TempFile();
+    LoggedSegmentTree tree(expected, log);
+    tree.Checkpoint(checkpoint);
+    RandomUpdates(rng, tree, expected, 100);
+    tree.Commit();
+
+    std::signal(SIGXFSZ, SIG_IGN);
+    struct rlimit limit;
+    CHECK(::getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    struct rlimit low = limit;
+    low.rlim_cur = FileSize(log) + 1000;
+    CHECK(::setrlimit(RLIMIT_FSIZE, &low) == 0);
+    RandomUpdates(rng, tree, expected, 500);
+    bool threw = false;
+    try
+    {
+      tree.Commit();
+    }
+    catch (const std::system_error &)
+    {
+      threw = true;
+    }
+    CHECK(::setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    CHECK(threw);
+    RandomUpdates(rng, tree, expected, 100);
+    tree.Commit();
+
+    Rewind(checkpoint);
+    LoggedSegmentTree recovered(checkpoint, log);
+    CheckEqual(recovered, expected);
+  }
+
+  // Committing past the last update throws, instead of waiting forever.
+  {
+    int log = TempFile();
+    LoggedSegmentTree tree(std::vector<int>(10, 0), log);
+    uint64_t lsn = tree.AddToRange({0, 10}, 1);
+    bool threw = false;
+    try
+    {
+      tree.Commit(lsn + 1);
+    }
+    catch (const std::invalid_argument &)
+    {
+      threw = true;
+    }
+    CHECK(threw);
+    tree.Commit(lsn);
+    CHECK(FileSize(log) > 0);
+  }
+
+  // Concurrent committers: every update is recovered.
+  {
+    std::vector<int> ones(n, 1);
+    int log = TempFile(), checkpoint = TempFile();
+    {
+      LoggedSegmentTree tree(ones, log);
+      tree.Checkpoint(checkpoint);
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; t++)
+        threads.emplace_back(
+            [&tree, n, t]
+            {
+              std::mt19937 rng(t);
+              for (int i = 0; i < 2000; i++)
+              {
+                int l = rng() % n;
+                uint64_t lsn = tree.AddToRange({l, std::min(n, l + 50)}, 1);
+                if (i % 100 == 0)
+                  tree.Commit(lsn);
+              }
+            });
+      for (std::thread &thread : threads)
+        thread.join();
+      tree.Commit();
+      int sum = tree.QueryRange({0, n});
+      Rewind(checkpoint);
+      LoggedSegmentTree recovered(checkpoint, log);
+      CHECK(recovered.QueryRange({0, n}) == sum);
+    }
+  }
+  return 0;
+}
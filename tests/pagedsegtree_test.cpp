@@ -0,0 +1,164 @@
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+#include "pagedsegtree.h"
+
+// An anonymous temporary file, closed at exit.
+static int TempFile()
+{
+  std::FILE *file = std::tmpfile();
+  CHECK(file != nullptr);
+  return fileno(file);
+}
+
+using Layout = PagedSegmentTree::Layout;
+
+// Random updates and queries against a reference array, then the file
+// reopened after the tree is destroyed.
+static void TestRandom(std::mt19937 &rng, Layout layout, bool build)
+{
+  int n = rng() % 50000 + 1;
+  std::vector<int> arr(n, 0);
+  if (build)
+    for (int &x : arr)
+      x = rng() % 100;
+  int fd = TempFile();
+  {
+    int pool_pages = rng() % 100;
+    PagedSegmentTree tree = build
+                                ? PagedSegmentTree(fd, arr, pool_pages, layout)
+                                : PagedSegmentTree(fd, n, pool_pages, layout);
+    for (int q = 0; q < 1000; q++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      if (rng() % 3 == 0)
+      {
+        l = rng() % n;
+        r = std::min<int>(n, l + rng() % 5 + 1);
+      }
+      int type = rng() % 5, val = int(rng() % 20) - 10;
+      if (type <= 1)
+      {
+        tree.AddToRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] += val;
+      }
+      else if (type == 2)
+      {
+        tree.AssignRange({l, r}, val);
+        for (int i = l; i < r; i++)
+          arr[i] = val;
+      }
+      else
+      {
+        int64_t sum = 0;
+        for (int i = l; i < r; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange({l, r}) == sum);
+      }
+    }
+  }
+  PagedSegmentTree reopened = PagedSegmentTree::Open(fd, 70);
+  CHECK(reopened.size() == n);
+  for (int q = 0; q < 100; q++)
+  {
+    int i = rng() % n;
+    CHECK(reopened.Get(i) == arr[i]);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(93);
+  for (int it = 0; it < 24; it++)
+  {
+    Layout layout = it % 3 == 0   ? Layout::kDirect
+                    : it % 3 == 1 ? Layout::kBuffered
+                                  : Layout{3, 7};
+    TestRandom(rng, layout, it % 2);
+  }
+
+  // Over a power of two elements, whatever the depth modulo the page
+  // height, the bottom pages are full, and buffers only take pages above
+  // them: the file holds about twice the nodes' 32 bytes per element,
+  // written a page at a time, and a point query reads a page per page level.
+  // Then buffering cuts the pages short adds write by an order of magnitude.
+  for (int k = 14; k <= 17; k++)
+  {
+    int n = 1 << k;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = rng() % 100 + 1;
+    uint64_t add_writes[2];
+    for (Layout layout : {Layout::kDirect, Layout::kBuffered})
+    {
+      int fd = TempFile();
+      PagedSegmentTree tree(fd, arr, 64, layout);
+      tree.Flush();
+      off_t file_bytes = ::lseek(fd, 0, SEEK_END);
+      CHECK(file_bytes <= 64 * off_t(n) + 40 * 20480);
+      CHECK(tree.page_writes() <= uint64_t(file_bytes / 4096));
+      uint64_t reads = tree.page_reads();
+      for (int q = 0; q < 100; q++)
+      {
+        int i = rng() % n;
+        CHECK(tree.Get(i) == arr[i]);
+      }
+      CHECK(tree.page_reads() - reads <= 100 * 3);
+
+      std::mt19937 adds(k);
+      uint64_t writes = tree.page_writes();
+      for (int q = 0; q < 20000; q++)
+      {
+        int l = adds() % n;
+        tree.AddToRange({l, std::min(n, l + int(adds() % 100) + 1)}, 1);
+      }
+      tree.Flush();
+      add_writes[layout.buffer_capacity > 0] = tree.page_writes() - writes;
+    }
+    CHECK(add_writes[1] * 10 < add_writes[0]);
+  }
+
+  // More than 2^31 elements, and sums beyond 32 bits, in a sparse file.
+  for (Layout layout : {Layout::kDirect, Layout::kBuffered})
+  {
+    const int64_t n = int64_t(3) << 30;
+    PagedSegmentTree tree(TempFile(), n, 256, layout);
+    CHECK(tree.size() == n);
+    struct Add
+    {
+      PagedSegmentTree::Domain domain;
+      int inc;
+    };
+    std::vector<Add> adds;
+    std::uniform_int_distribution<int64_t> index(0, n - 1);
+    for (int q = 0; q < 200; q++)
+    {
+      int64_t l = index(rng), r = index(rng);
+      if (l > r)
+        std::swap(l, r);
+      adds.push_back({{l, r + 1}, int(rng() % 7) + 1});
+      tree.AddToRange(adds.back().domain, adds.back().inc);
+
+      int64_t ql = index(rng), qr = index(rng);
+      if (ql > qr)
+        std::swap(ql, qr);
+      PagedSegmentTree::Domain query = {ql, qr + 1};
+      int64_t sum = 0;
+      for (const Add &add : adds)
+        sum += (add.domain & query).Volume() > 0
+                   ? (add.domain & query).Volume() * add.inc
+                   : 0;
+      CHECK(tree.QueryRange(query) == sum);
+    }
+    CHECK(tree.QueryRange({0, n}) > (int64_t(1) << 32));
+  }
+  return 0;
+}
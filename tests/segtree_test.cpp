@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "segtree.h"
+
+static Cube RandomRange(std::mt19937 &rng, int n)
+{
+  int l = rng() % n, r = rng() % n;
+  if (l > r)
+    std::swap(l, r);
+  return {l, r + 1};
+}
+
+// Sparse non-negative values, against a reference array.
+static void TestForEachNonZero(std::mt19937 &rng)
+{
+  int n = rng() % 500 + 1;
+  std::vector<int> arr(n, 0);
+  for (int i = 0; i < 5; i++)
+    arr[rng() % n] = rng() % 5;
+  SegmentTree tree(arr);
+  for (int q = 0; q < 100; q++)
+  {
+    auto [l, r] = RandomRange(rng, n);
+    int type = rng() % 4, val = rng() % 3;
+    if (type == 0)
+    {
+      tree.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] += val;
+    }
+    else if (type == 1)
+    {
+      tree.AssignRange({l, r}, 0);
+      for (int i = l; i < r; i++)
+        arr[i] = 0;
+    }
+    else if (type == 2)
+    {
+      tree.AssignRange({l, l + 1}, val);
+      arr[l] = val;
+    }
+    else
+    {
+      std::vector<std::pair<int, int>> found, expected;
+      tree.ForEachNonZero({l, r}, [&](int i, int value)
+                          { found.push_back({i, value}); });
+      for (int i = l; i < r; i++)
+        if (arr[i] != 0)
+          expected.push_back({i, arr[i]});
+      CHECK(found == expected);
+    }
+  }
+}
+
+// Mixed batches of updates and queries, against executing them one by one
+// on a reference array.
+static void TestExecuteOrdered(std::mt19937 &rng)
+{
+  int n = rng() % 1000 + 1;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = int(rng() % 20) - 10;
+  SegmentTree tree(arr);
+  std::vector<Op> ops;
+  for (int round = 0; round < 20; round++)
+  {
+    // Runs of queries and of updates, with shared and covering ranges.
+    ops.resize(rng() % 100);
+    for (Op &op : ops)
+    {
+      op.domain = rng() % 4 ? RandomRange(rng, n) : Cube{0, n};
+      if (rng() % 10 == 0)
+        op.domain.r = op.domain.l;
+      op.op = {rng() % 3 == 0, int(rng() % 20) - 10};
+      op.is_query = rng() % 2;
+      op.result = 12345;
+    }
+    tree.ExecuteOrdered(ops);
+    for (const Op &op : ops)
+    {
+      int sum = 0;
+      for (int i = op.domain.l; i < op.domain.r; i++)
+      {
+        if (op.is_query)
+          sum += arr[i];
+        else
+          arr[i] = op.op.Evaluate(arr[i], {0, 1});
+      }
+      CHECK(op.result == (op.is_query ? sum : 0));
+    }
+    Cube domain = RandomRange(rng, n);
+    int sum = 0;
+    for (int i = domain.l; i < domain.r; i++)
+      sum += arr[i];
+    CHECK(tree.QueryRange(domain) == sum);
+  }
+}
+
+// A lazily built tree and its forks, against reference arrays: the first
+// traversals through each node build it, and the rest see it built.
+static void TestBuildLazily(std::mt19937 &rng)
+{
+  int n = rng() % 3000 + 1;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = int(rng() % 20) - 10;
+  std::vector<SegmentTree> trees;
+  std::vector<std::vector<int>> arrs;
+  trees.push_back(SegmentTree::BuildLazily(arr));
+  arrs.push_back(arr);
+  for (int q = 0; q < 100; q++)
+  {
+    int t = rng() % trees.size();
+    if (rng() % 20 == 0)
+    {
+      trees.push_back(trees[t].Fork());
+      arrs.push_back(arrs[t]);
+      continue;
+    }
+    std::vector<int> &values = arrs[t];
+    // Mostly short ranges, so that much of the tree stays unbuilt.
+    Cube domain = RandomRange(rng, n);
+    if (rng() % 4)
+      domain.r = std::min(n, domain.l + int(rng() % 10) + 1);
+    int type = rng() % 6, val = int(rng() % 20) - 10;
+    if (type == 0)
+    {
+      trees[t].AddToRange(domain, val);
+      for (int i = domain.l; i < domain.r; i++)
+        values[i] += val;
+    }
+    else if (type == 1)
+    {
+      trees[t].AssignRange(domain, val);
+      for (int i = domain.l; i < domain.r; i++)
+        values[i] = val;
+    }
+    else if (type == 2)
+    {
+      std::vector<Update> batch(rng() % 5);
+      for (Update &update : batch)
+      {
+        update = {RandomRange(rng, n), {rng() % 2 == 0, val}};
+        for (int i = update.domain.l; i < update.domain.r; i++)
+          values[i] = update.op.Evaluate(values[i], {0, 1});
+      }
+      trees[t].ApplyBatch(batch);
+    }
+    else
+    {
+      int sum = 0;
+      for (int i = domain.l; i < domain.r; i++)
+        sum += values[i];
+      CHECK(trees[t].QueryRange(domain) == sum);
+    }
+  }
+}
+
+// Updates to a lazily built tree build only the leaves they reach, however
+// far apart, and queries only the subtrees they cover.
+static void TestBuildLazilyCost(std::mt19937 &rng)
+{
+  int n = 1 << 20;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = int(rng() % 20) - 10;
+  SegmentTree tree = SegmentTree::BuildLazily(arr);
+  for (int q = 0; q < 10; q++)
+  {
+    int i = rng() % n, val = int(rng() % 20) - 10;
+    tree.Add(i, val);
+    arr[i] += val;
+    tree.Set(n - 1 - i, val);
+    arr[n - 1 - i] = val;
+    Cube domain = RandomRange(rng, n);
+    tree.AddToRange(domain, val);
+    for (int j = domain.l; j < domain.r; j++)
+      arr[j] += val;
+    tree.AssignRange({domain.l, domain.l + 1}, val);
+    arr[domain.l] = val;
+  }
+  // A few leaves per update, at the ends of its range and next to them.
+  CHECK(tree.NumBuilt() <= 40 * 4);
+
+  for (int q = 0; q < 10; q++)
+  {
+    int l = rng() % (n - 10);
+    int sum = 0;
+    for (int i = l; i < l + 10; i++)
+      sum += arr[i];
+    CHECK(tree.QueryRange({l, l + 10}) == sum);
+    CHECK(tree.Get(l) == arr[l]);
+  }
+  CHECK(tree.NumBuilt() <= 40 * 4 + 10 * 40);
+
+  int sum = 0;
+  for (int x : arr)
+    sum += x;
+  CHECK(tree.QueryRange({0, n}) == sum);
+  CHECK(tree.QueryPrefix(n / 3) == tree.QueryRange({0, n / 3}));
+}
+
+// Trees over 2^k elements are built level by level: check every level
+// against sums of the reference array, through queries of aligned ranges,
+// up to sizes whose levels span many pages.
+static void TestBuildLevels(std::mt19937 &rng)
+{
+  for (int k = 0; k <= 16; k++)
+  {
+    int n = 1 << k;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = int(rng() % 2000) - 1000;
+    SegmentTree tree(arr);
+    for (int width = 1; width <= n; width *= 2)
+      for (int q = 0; q < 20; q++)
+      {
+        int l = rng() % (n / width) * width;
+        int sum = 0;
+        for (int i = l; i < l + width; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange({l, l + width}) == sum);
+      }
+    Cube domain = RandomRange(rng, n);
+    tree.AddToRange(domain, 1);
+    int sum = 0;
+    for (int i = 0; i < n; i++)
+      sum += arr[i] + (domain.l <= i && i < domain.r);
+    CHECK(tree.QueryRange({0, n}) == sum);
+  }
+}
+
+// Point reads and writes interleaved with range updates, which leave
+// additions and assignments pending on their paths, on eagerly and lazily
+// built trees, against a reference array.
+static void TestPointUpdates(std::mt19937 &rng)
+{
+  int n = rng() % 1000 + 1;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = int(rng() % 20) - 10;
+  SegmentTree tree =
+      rng() % 2 ? SegmentTree(arr) : SegmentTree::BuildLazily(arr);
+  for (int q = 0; q < 500; q++)
+  {
+    Cube domain = RandomRange(rng, n);
+    int i = rng() % n;
+    int type = rng() % 6, val = int(rng() % 20) - 10;
+    if (type == 0)
+    {
+      tree.AddToRange(domain, val);
+      for (int j = domain.l; j < domain.r; j++)
+        arr[j] += val;
+    }
+    else if (type == 1)
+    {
+      tree.AssignRange(domain, val);
+      for (int j = domain.l; j < domain.r; j++)
+        arr[j] = val;
+    }
+    else if (type == 2)
+    {
+      tree.Set(i, val);
+      arr[i] = val;
+    }
+    else if (type == 3)
+    {
+      tree.Add(i, val);
+      arr[i] += val;
+    }
+    else if (type == 4)
+      CHECK(tree.Get(i) == arr[i]);
+    else
+    {
+      int sum = 0;
+      for (int j = domain.l; j < domain.r; j++)
+        sum += arr[j];
+      CHECK(tree.QueryRange(domain) == sum);
+    }
+  }
+}
+
+// Prefixes and suffixes, which are read down a single path past pending
+// operations, against a reference array.
+static void TestPrefixSuffix(std::mt19937 &rng)
+{
+  int n = rng() % 1000 + 1;
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = int(rng() % 20) - 10;
+  SegmentTree tree =
+      rng() % 2 ? SegmentTree(arr) : SegmentTree::BuildLazily(arr);
+  for (int q = 0; q < 300; q++)
+  {
+    Cube domain = RandomRange(rng, n);
+    Operation op = {rng() % 2 == 0, int(rng() % 20) - 10};
+    if (rng() % 2)
+    {
+      tree.ApplyToRange(domain, op);
+      for (int i = domain.l; i < domain.r; i++)
+        arr[i] = op.Evaluate(arr[i], {0, 1});
+      continue;
+    }
+    // Every prefix and suffix, the empty and the full ones too.
+    int r = rng() % (n + 1);
+    int prefix = 0, suffix = 0;
+    for (int i = 0; i < r; i++)
+      prefix += arr[i];
+    for (int i = r; i < n; i++)
+      suffix += arr[i];
+    CHECK(tree.QueryPrefix(r) == prefix);
+    CHECK(tree.QuerySuffix(r) == suffix);
+    CHECK(tree.QueryRange({0, r}) == prefix);
+    CHECK(tree.QueryRange({r, n}) == suffix);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(0);
+  for (int it = 0; it < 300; it++)
+  {
+    TestForEachNonZero(rng);
+    TestExecuteOrdered(rng);
+    TestBuildLazily(rng);
+    TestPointUpdates(rng);
+    TestPrefixSuffix(rng);
+  }
+  TestBuildLazilyCost(rng);
+  TestBuildLevels(rng);
+  return 0;
+}
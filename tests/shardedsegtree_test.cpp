@@ -0,0 +1,117 @@
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "shardedsegtree.h"
+
+int main()
+{
+  std::mt19937 rng(77);
+
+  // Updates from a few threads in turn, each with its own shard, against a
+  // reference array.
+  for (int it = 0; it < 50; it++)
+  {
+    int n = rng() % 500 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = int(rng() % 20) - 10;
+    ShardedSegmentTree tree(arr);
+    for (int round = 0; round < 10; round++)
+    {
+      int seed = rng();
+      std::thread writer(
+          [&tree, &arr, n, seed]
+          {
+            std::mt19937 rng(seed);
+            for (int q = 0; q < 50; q++)
+            {
+              int l = rng() % n, r = rng() % n;
+              if (l > r)
+                std::swap(l, r);
+              int inc = int(rng() % 20) - 10;
+              // Empty ranges too.
+              tree.AddToRange({l, r}, inc);
+              for (int i = l; i < r; i++)
+                arr[i] += inc;
+            }
+          });
+      writer.join();
+      if (rng() % 3 == 0)
+        tree.Consolidate();
+      for (int q = 0; q < 20; q++)
+      {
+        int l = rng() % n, r = rng() % n;
+        if (l > r)
+          std::swap(l, r);
+        r++;
+        int sum = 0;
+        for (int i = l; i < r; i++)
+          sum += arr[i];
+        CHECK(tree.QueryRange({l, r}) == sum);
+      }
+    }
+  }
+
+  // One thread cycling through more trees than its shard cache holds, some
+  // of them replaced by new trees at the same address on the way: every
+  // tree keeps exactly its own updates.
+  {
+    int n = 100;
+    std::vector<std::unique_ptr<ShardedSegmentTree>> trees;
+    std::vector<int> totals;
+    for (int t = 0; t < 10; t++)
+    {
+      trees.push_back(
+          std::make_unique<ShardedSegmentTree>(std::vector<int>(n, 0)));
+      totals.push_back(0);
+    }
+    for (int q = 0; q < 2000; q++)
+    {
+      int t = rng() % trees.size();
+      if (rng() % 50 == 0)
+      {
+        trees[t].reset();
+        trees[t] = std::make_unique<ShardedSegmentTree>(std::vector<int>(n, 0));
+        totals[t] = 0;
+      }
+      int l = rng() % n;
+      trees[t]->AddToRange({l, l + 1}, 1);
+      totals[t]++;
+      if (rng() % 10 == 0)
+        trees[t]->Consolidate();
+      CHECK(trees[t]->QueryRange({0, n}) == totals[t]);
+    }
+  }
+
+  // Concurrent writers, with queries and consolidations racing them: every
+  // query sees a multiple of the update size, and every update lands.
+  {
+    int n = 1000;
+    ShardedSegmentTree tree(std::vector<int>(n, 0));
+    std::atomic<int> done = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+      threads.emplace_back(
+          [&tree, &done, n]
+          {
+            for (int i = 0; i < 20000; i++)
+              tree.AddToRange({i % (n - 9), i % (n - 9) + 10}, 1);
+            done++;
+          });
+    while (done < 4)
+    {
+      CHECK(tree.QueryRange({0, n}) % 10 == 0);
+      tree.Consolidate();
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+    CHECK(tree.QueryRange({0, n}) == 4 * 20000 * 10);
+    tree.Consolidate();
+    CHECK(tree.QueryRange({0, n}) == 4 * 20000 * 10);
+  }
+  return 0;
+}
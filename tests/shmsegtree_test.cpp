@@ -0,0 +1,108 @@
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+#include "shmsegtree.h"
+
+int main()
+{
+  std::string name = "/shmsegtree_test." + std::to_string(::getpid());
+  std::mt19937 rng(81);
+  int n = 10000;
+
+  // The writer against a reference array, and a reader seeing its writes.
+  std::vector<int> arr(n);
+  for (int &x : arr)
+    x = rng() % 10;
+  SharedSegmentTree writer(name, arr);
+  SharedSegmentTreeReader reader(name);
+  CHECK(reader.size() == n);
+  for (int q = 0; q < 2000; q++)
+  {
+    int l = rng() % n;
+    int r = std::min<int>(n, l + 1 + rng() % 500);
+    int val = rng() % 10;
+    if (q % 3 == 0)
+    {
+      writer.AssignRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] = val;
+    }
+    else if (q % 3 == 1)
+    {
+      writer.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        arr[i] += val;
+    }
+    int sum = 0;
+    for (int i = l; i < r; i++)
+      sum += arr[i];
+    if (q % 2)
+      CHECK(writer.QueryRange({l, r}) == sum);
+    else
+      CHECK(reader.QueryRange({l, r}) == sum);
+  }
+
+  // Readers racing the writer see every prefix of its additions: the total
+  // only grows, by multiples of 3.
+  {
+    SharedSegmentTree counter(name, std::vector<int>(n, 1));
+    std::atomic<bool> done = false;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++)
+      readers.emplace_back(
+          [&name, &done, n]
+          {
+            SharedSegmentTreeReader reader(name);
+            int last = n;
+            while (!done.load())
+            {
+              int sum = reader.QueryRange({0, n});
+              CHECK(sum >= last && (sum - n) % 3 == 0);
+              last = sum;
+              CHECK(reader.QueryRange({0, n / 2}) +
+                        reader.QueryRange({n / 2, n}) >=
+                    last);
+            }
+          });
+    for (int i = 0; i < 100000; i++)
+    {
+      int l = rng() % n;
+      counter.AddToRange({l, std::min(n, l + 1 + i % 100)}, 3);
+      if (i % 1000 == 0)
+        counter.QueryRange({0, n});
+    }
+    done = true;
+    for (std::thread &thread : readers)
+      thread.join();
+
+    // Recreating the segment leaves readers of the old one reading it.
+    SharedSegmentTreeReader old_reader(name);
+    int old_sum = old_reader.QueryRange({0, n});
+    SharedSegmentTree replacement(name, std::vector<int>(2 * n, 2));
+    CHECK(old_reader.QueryRange({0, n}) == old_sum);
+    SharedSegmentTreeReader new_reader(name);
+    CHECK(new_reader.size() == 2 * n);
+    CHECK(new_reader.QueryRange({0, 2 * n}) == 4 * n);
+  }
+
+  // Empty queries, and an empty segment.
+  {
+    SharedSegmentTreeReader reader(name);
+    CHECK(reader.QueryRange({5, 5}) == 0);
+    SharedSegmentTree empty(name, {});
+    SharedSegmentTreeReader empty_reader(name);
+    CHECK(empty_reader.size() == 0);
+    CHECK(empty_reader.QueryRange({0, 0}) == 0);
+    CHECK(empty.QueryRange({0, 0}) == 0);
+    empty.AddToRange({0, 0}, 1);
+  }
+
+  SharedSegmentTree::Unlink(name);
+  return 0;
+}
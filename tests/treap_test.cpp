@@ -0,0 +1,115 @@
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "treap.h"
+
+// A treap and its reference sequence.
+struct Model
+{
+  ImplicitTreap treap;
+  std::vector<int> values;
+};
+
+static void CheckModel(std::mt19937 &rng, Model &model)
+{
+  int n = model.values.size();
+  CHECK(model.treap.size() == n);
+  if (n == 0)
+    return;
+  int l = rng() % n, r = rng() % n;
+  if (l > r)
+    std::swap(l, r);
+  r++;
+  int sum = 0;
+  for (int i = l; i < r; i++)
+    sum += model.values[i];
+  CHECK(model.treap.QueryRange({l, r}) == sum);
+  int i = rng() % n;
+  CHECK(model.treap.Get(i) == model.values[i]);
+}
+
+// Random updates, inserts, erases, splits and concatenations over a few
+// treaps, some sharing a pool and some not, against reference sequences.
+static void TestRandom(std::mt19937 &rng)
+{
+  std::vector<Model> models;
+  std::vector<int> arr(rng() % 100);
+  for (int &x : arr)
+    x = int(rng() % 100) - 50;
+  models.push_back({ImplicitTreap(arr), arr});
+  for (int q = 0; q < 500; q++)
+  {
+    Model &model = models[rng() % models.size()];
+    std::vector<int> &values = model.values;
+    int n = values.size();
+    int op = rng() % 8;
+    int l = n ? rng() % n : 0, r = n ? rng() % n : 0;
+    if (l > r)
+      std::swap(l, r);
+    if (n)
+      r++;
+    int val = int(rng() % 20) - 10;
+    if (op == 0)
+    {
+      model.treap.AddToRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        values[i] += val;
+    }
+    else if (op == 1)
+    {
+      model.treap.AssignRange({l, r}, val);
+      for (int i = l; i < r; i++)
+        values[i] = val;
+    }
+    else if (op == 2 || op == 3)
+    {
+      int pos = rng() % (n + 1);
+      model.treap.Insert(pos, val);
+      values.insert(values.begin() + pos, val);
+    }
+    else if (op == 4)
+    {
+      model.treap.Erase({l, r});
+      values.erase(values.begin() + l, values.begin() + r);
+    }
+    else if (op == 5 && models.size() < 6)
+    {
+      int pos = rng() % (n + 1);
+      Model split = {model.treap.Split(pos),
+                     std::vector<int>(values.begin() + pos, values.end())};
+      values.resize(pos);
+      models.push_back(std::move(split));
+    }
+    else if (op == 6 && models.size() > 1)
+    {
+      // Append the last treap to another.
+      Model &other = models[rng() % (models.size() - 1)];
+      Model last = std::move(models.back());
+      models.pop_back();
+      other.treap.Concat(last.treap);
+      other.values.insert(other.values.end(), last.values.begin(),
+                          last.values.end());
+      CHECK(last.treap.size() == 0);
+      CheckModel(rng, other);
+      continue;
+    }
+    else if (op == 7 && models.size() < 6)
+    {
+      // A treap with its own pool.
+      std::vector<int> fresh(rng() % 50, val);
+      models.push_back({ImplicitTreap(fresh), fresh});
+    }
+    for (Model &other : models)
+      CheckModel(rng, other);
+  }
+}
+
+int main()
+{
+  std::mt19937 rng(88);
+  for (int it = 0; it < 200; it++)
+    TestRandom(rng);
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+#include "uring.h"
+
+int main()
+{
+  std::unique_ptr<IoUring> ring;
+  try
+  {
+    ring = std::make_unique<IoUring>(16);
+  }
+  catch (const std::system_error &)
+  {
+    return 0; // io_uring unavailable: nothing to test.
+  }
+
+  std::mt19937 rng(95);
+  int chunk = 1 << 16, num_chunks = 16;
+  std::vector<char> data(chunk * num_chunks);
+  for (char &c : data)
+    c = rng();
+  std::FILE *file = std::tmpfile();
+  CHECK(file != nullptr);
+  int fd = fileno(file);
+  CHECK(::write(fd, data.data(), data.size()) == ssize_t(data.size()));
+
+  // Drain returns once every submitted read has landed, with none left to
+  // reap.
+  for (int round = 0; round < 10; round++)
+  {
+    std::vector<char> buffer(data.size());
+    std::vector<struct iovec> iov(num_chunks);
+    for (int c = 0; c < num_chunks; c++)
+    {
+      iov[c] = {buffer.data() + c * chunk, size_t(chunk)};
+      CHECK(ring->PrepareReadv(fd, &iov[c], 1, off_t(c) * chunk, c));
+    }
+    ring->Submit(0);
+    ring->Drain();
+    CHECK(buffer == data);
+    uint64_t c;
+    int res;
+    CHECK(!ring->Reap(c, res));
+  }
+
+  // Including the completions already there, reaped or not.
+  std::vector<char> buffer(chunk);
+  struct iovec iov = {buffer.data(), size_t(chunk)};
+  CHECK(ring->PrepareReadv(fd, &iov, 1, 0, 0));
+  ring->Submit(1);
+  ring->Drain();
+  ring->Drain();
+  uint64_t c;
+  int res;
+  CHECK(!ring->Reap(c, res));
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "waveletmatrix.h"
+
+int main()
+{
+  std::mt19937 rng(83);
+  for (int it = 0; it < 300; it++)
+  {
+    // Few or many distinct values, and the extremes of int.
+    int n = rng() % 300 + 1;
+    int sigma = it % 2 ? rng() % 4 + 1 : rng() % 100000 + 1;
+    std::vector<int> arr(n);
+    for (int &x : arr)
+      x = int(rng() % sigma) - sigma / 2;
+    if (it % 10 == 0)
+      arr[rng() % n] = INT_MIN;
+    if (it % 10 == 1)
+      arr[rng() % n] = INT_MAX;
+    WaveletMatrix matrix(arr);
+    CHECK(matrix.size() == n);
+    for (int q = 0; q < 200; q++)
+    {
+      int l = rng() % n, r = rng() % n;
+      if (l > r)
+        std::swap(l, r);
+      r++;
+      std::vector<int> sorted(arr.begin() + l, arr.begin() + r);
+      std::sort(sorted.begin(), sorted.end());
+      int k = rng() % (r - l);
+      CHECK(matrix.KthSmallest({l, r}, k) == sorted[k]);
+
+      // Values present and absent, and past either end.
+      int x = rng() % 4 == 0 ? arr[rng() % n]
+                             : int(rng() % (sigma + 2)) - sigma / 2 - 1;
+      if (q % 50 == 0)
+        x = q % 100 ? INT_MAX : INT_MIN;
+      int count = std::lower_bound(sorted.begin(), sorted.end(), x) -
+                  sorted.begin();
+      CHECK(matrix.CountLess({l, r}, x) == count);
+      CHECK(matrix.CountLess({l, l}, x) == 0);
+    }
+  }
+  return 0;
+}